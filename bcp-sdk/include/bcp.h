@@ -190,6 +190,11 @@ typedef struct {
     struct bcp_crc_t {
         /**
          * @brief Calculates the CRC-16 checksum for a given data buffer.
+         *
+         * Optional. NULL selects the built-in CRC-16/XMODEM engine, which
+         * uses carry-less multiply on CPUs that have it. Set it to
+         * offload the checksum to a CRC peripheral.
+         *
          * @param data Pointer to the data buffer.
          * @param len The length of the data buffer in bytes.
          * @return The calculated CRC-16 checksum.
@@ -197,6 +202,20 @@ typedef struct {
         uint16_t (*crc16_cal)(void *data, uint32_t len);
     } bcp_crc;
 
+    struct bcp_random_t {
+        /**
+         * @brief Fills a buffer with random bytes.
+         *
+         * Optional, only needed by BCP blocks created with an aead_key.
+         * The bytes must not repeat across restarts, a hardware RNG or
+         * the random device of the OS is fine.
+         *
+         * @param buf Pointer to the buffer to fill.
+         * @param len The length of the buffer in bytes.
+         */
+        void (*random_fill)(void *buf, uint32_t len);
+    } bcp_random;
+
 } bcp_adapter_port_t;
 
 
@@ -207,12 +226,94 @@ typedef struct {
     void *user_data;
 } bcp_block_t;
 
+typedef struct _bcp_table_t bcp_table_t;
+
+typedef struct _bcp_executor_t bcp_executor_t;
+
+typedef struct {
+    uint32_t thread_num;                // Number of worker threads, typically one per core.
+    uint32_t session_num;               // Maximum number of BCP blocks served at the same time, bcp_create refuses more.
+
+    char *thread_name;
+    int32_t thread_priority;
+    uint32_t thread_stack_size;
+} bcp_executor_parm_t;
+
+typedef struct _bcp_slab_t bcp_slab_t;
+
+typedef struct {
+    uint32_t block_size;                // Usable bytes of each block of the class.
+    uint32_t block_num;                 // Number of blocks of the class, less than 65535.
+} bcp_slab_class_t;
+
+typedef struct {
+    const bcp_slab_class_t *classes;    // Size classes, each allocation takes a block from the smallest class that fits.
+    uint32_t class_num;
+} bcp_slab_parm_t;
+
+typedef enum {
+    BCP_WORK_MODE_THREAD = 0,           // An internal worker thread is spawned to process the events of the BCP block.
+    BCP_WORK_MODE_EXTERNAL,             // No worker thread, the host drives the BCP block from its own event loop with bcp_process.
+    BCP_WORK_MODE_EXECUTOR,             // The events are processed by the worker threads of a shared executor.
+} bcp_work_mode_t;
+
+// Guarantees the transport under BCP already gives, combined into
+// bcp_parm_t.transport. A stage is skipped only when both peers declare
+// the guarantee at SYNC. Fragmentation follows mtu, a transport taking
+// whole frames sets mfs_scale to 1. With RELIABLE nothing is retransmitted,
+// a packet bcp_input refuses must be passed in again rather than dropped.
+// On a byte stream INTEGRITY is only used together with RELIABLE.
+typedef enum {
+    BCP_TRANSPORT_INTEGRITY = 0x01,     // Corrupted packets never reach bcp_input, a data frame sent in one packet goes
+                                        // without crc, and with RELIABLE every data frame does.
+    BCP_TRANSPORT_RELIABLE = 0x02,      // Packets arrive once and in order, data frames are neither acked nor retained.
+} bcp_transport_cap_t;
+
+#define BCP_TRANSPORT_PROFILE_RAW       0                                                   // UART, RS-485
+#define BCP_TRANSPORT_PROFILE_DATAGRAM  (BCP_TRANSPORT_INTEGRITY)                           // UDP, BLE notifications
+#define BCP_TRANSPORT_PROFILE_STREAM    (BCP_TRANSPORT_INTEGRITY | BCP_TRANSPORT_RELIABLE)  // TCP, local pipe
+
+// Returned by bcp_next_deadline_ms when no timeout is pending.
+#define BCP_NO_DEADLINE                 0xFFFFFFFFu
+
 typedef struct {
     uint8_t  mfs_scale;                 // Number of mtu packets for crc inspection and retransmission each time.The recommended value is less than 5.
     uint16_t mtu;                       // The true effective value of mtu, such as 20 for ble4.0
     uint32_t mal;                       // The maximum amount of data sent by the upper layer each time. This value will affect the memory consumption. 
                                         // It is recommended that it not exceed 8192.
-
+    uint8_t  byte_stream;               // Set to 1 if the transport is a byte stream without packet boundaries (e.g. UART, RS-485).
+                                        // Data is then fed with bcp_input_stream, both peers must use the same mtu * mfs_scale.
+
+    bcp_slab_t *slab;                   // Optional slab shared by many BCP blocks, NULL to preallocate private pools.
+    uint32_t slab_quota;                // Maximum bytes of slab blocks the BCP block may hold at once, 0 for no limit.
+    uint16_t frame_pool_max;            // Ceiling of the elastic frame pool in blocks, 0 for a fixed pool. The pool then starts
+                                        // with one message worth of frames and grows by that amount, at most 8 times.
+    uint16_t mtu_pool_max;              // Ceiling of the elastic mtu pool in blocks, 0 for a fixed pool of mfs_scale * 2 blocks.
+                                        // Elastic pools give grown memory back after being mostly idle for BCP_POOL_IDLE_MS.
+    uint32_t hibernate_ms;              // Idle time after which the BCP block releases its pools, receive buffers and work
+                                        // thread, 0 to never hibernate. The next call inflates it again transparently.
+    uint8_t  crc32c;                    // Set to 1 to offer CRC-32C trailers on data frames at SYNC, used when the peer
+                                        // offers them too. Hardware accelerated where the CPU has CRC instructions; a peer
+                                        // that predates the option rejects the longer SYNC_REQ, so enable it on both ends.
+    uint8_t  transport;                 // bcp_transport_cap_t flags or a BCP_TRANSPORT_PROFILE_*, 0 to run every stage.
+    uint8_t  compress;                  // Set to 1 to offer LZ compression of messages at SYNC, used when the peer offers it
+                                        // too. A dictionary of the last 4 KB sent carries over between messages, a message
+                                        // that does not shrink goes raw. Costs about 17 KB plus twice mal per BCP block, and
+                                        // bcp_send must then be called from one thread at a time.
+    uint16_t aggregate_ms;              // Coalescing window in ms offered at SYNC, 0 to send every message in its own frame.
+                                        // Messages that fit in one packet with room to spare are held up to this long and
+                                        // sent together, one frame, one ACK. Used when both ends offer it.
+    uint8_t  wide_len;                  // Set to 1 to offer 32 bit frame lengths at SYNC, needed for mtu * mfs_scale above
+                                        // 65535. Data frames then carry 2 more head bytes. With a peer that does not offer
+                                        // it frames stay below 64 KB, messages up to mal are fine either way.
+    const uint8_t *aead_key;            // Optional 32 byte ChaCha20-Poly1305 key shared by both peers. Data frames are then
+                                        // enciphered and authenticated, a 16 byte tag replaces the crc. Both ends need the
+                                        // key, a peer without one is refused at SYNC. The SYNC exchange itself stays in clear,
+                                        // each receiver binds the tags to a value it draws per peer salt, so frames recorded
+                                        // earlier are refused after any SYNC. A forged SYNC can still break the link.
+
+    uint8_t  work_mode;                 // bcp_work_mode_t, the work thread parameters below are only used in BCP_WORK_MODE_THREAD.
+    bcp_executor_t *executor;           // The executor serving the BCP block in BCP_WORK_MODE_EXECUTOR.
     char *work_thread_name;
     int32_t work_thread_priority;
     uint32_t work_thread_stack_size;
@@ -228,10 +329,34 @@ typedef enum {
 
 } bcp_open_status_t;
 
+typedef enum {
+    BCP_POOL_FRAME = 0,                 // Frames waiting to be sent or acknowledged.
+    BCP_POOL_MTU,                       // Received packets waiting to be processed.
+    BCP_POOL_SND_LIST,                  // Pending bcp_send calls.
+    BCP_POOL_NUM,
+} bcp_pool_id_t;
+
+typedef struct {
+    uint32_t block_size;
+    uint32_t capacity;                  // Blocks currently backed by memory.
+    uint32_t ceiling;                   // Blocks the pool may grow to.
+    uint32_t in_use;
+    uint32_t high_watermark;            // Highest in_use seen since creation.
+    uint32_t grow_count;
+    uint32_t shrink_count;
+    uint32_t alloc_fail;                // Allocations that failed even after trying to grow.
+} bcp_pool_stats_t;
+
+// One transport packet handed to the vectored output interface.
+typedef struct {
+    void *data;
+    uint32_t len;
+} bcp_slice_t;
+
 typedef struct {
 
     /**
-     * @description: The interface of low level data output.
+     * @description: The interface of low level data output. It may be NULL if output_batch is provided.
      * @param {bcp_block_t} *bcp_block Pointer to the BCP block instance.
      * @param {void} *data Indicates the pointer to the data to send.
      * @param {uint32_t} len  Indicates the data size. 
@@ -239,6 +364,20 @@ typedef struct {
      */
     int32_t (*output)(const bcp_block_t *bcp_block, void *data, uint32_t len);
 
+    /**
+     * @description: Optional vectored interface of low level data output. When set, data frames (including
+     *               retransmissions) are handed over as a vector of mtu slices, so a whole window can be
+     *               flushed at once (e.g. with sendmmsg). Control frames still use output if it is set.
+     * @param {bcp_block_t} *bcp_block Pointer to the BCP block instance.
+     * @param {bcp_slice_t} *slices Indicates the slices to send, each one is a transport packet.
+     * @param {uint32_t} count Indicates the number of slices.
+     * @param {uint32_t} seg_size Segmentation offload hint. If it is not 0, the slices are contiguous in memory and
+     *                   all but the last one are exactly seg_size bytes long, so the whole range starting at
+     *                   slices[0].data may be written at once (e.g. with UDP GSO).
+     * @return {*} 0 will be returned if the execution is successful, otherwise, values less than 0 will be returned.
+     */
+    int32_t (*output_batch)(const bcp_block_t *bcp_block, const bcp_slice_t *slices, uint32_t count, uint32_t seg_size);
+
     /**
      * @description: Notify the upper layer of data arrival.
      * @param {bcp_block_t} *bcp_block Pointer to the BCP block instance.
@@ -247,6 +386,15 @@ typedef struct {
      * @return {*}
      */
     void (*data_listener)(const bcp_block_t *bcp_block, void *data, uint32_t len);
+
+    /**
+     * @description: Notify the host that events are pending, only used in BCP_WORK_MODE_EXTERNAL.
+     *               It may be called from any thread that calls into BCP (or from the adapter timer),
+     *               so it should only wake up the event loop (e.g. write an eventfd), which then calls bcp_process.
+     * @param {bcp_block_t} *bcp_block Pointer to the BCP block instance.
+     * @return {*}
+     */
+    void (*event_notify)(const bcp_block_t *bcp_block);
 } bcp_interface_t;
 
 
@@ -264,6 +412,31 @@ typedef enum {
 
 void bcp_log_level_set(bcp_log_level_t level);
 
+typedef struct {
+    uint32_t budget;                    // 0 means no limit.
+    uint32_t used;                      // Heap bytes held by all BCP blocks and slabs.
+    uint32_t peak;
+    uint32_t refused;                   // Allocations refused because of the budget.
+} bcp_mem_stats_t;
+
+/**
+ * @brief Sets the process wide heap budget shared by all BCP blocks.
+ *
+ * Block creation, the receive buffers allocated on sync and slab creation
+ * are refused once they would exceed the budget, elastic pools stop growing
+ * at BCP_MEM_ELASTIC_PERCENT of it. Blocks created in a static arena are
+ * not charged.
+ *
+ * @param budget The budget in bytes, 0 to disable the limit.
+ */
+void bcp_mem_budget_set(uint32_t budget);
+
+/**
+ * @brief Gets the process wide heap usage of BCP.
+ * @param stats Filled with the current usage.
+ */
+void bcp_mem_stats_get(bcp_mem_stats_t *stats);
+
 void bcp_log_output_register(void (*log_output)(bcp_log_level_t level, const char *message));
 
 /**
@@ -274,6 +447,51 @@ void bcp_log_output_register(void (*log_output)(bcp_log_level_t level, const cha
  */
 void bcp_adapter_port_init(const bcp_adapter_port_t *bcp_adapter_port);
 
+/**
+ * @brief Creates an executor shared by many BCP blocks.
+ *
+ * The executor spawns a fixed number of worker threads which process the
+ * events of all the BCP blocks created with BCP_WORK_MODE_EXECUTOR and this
+ * executor. The events of one BCP block are never processed by two worker
+ * threads at the same time, so each block keeps the serial processing model.
+ *
+ * @param executor_parm Pointer to the executor parameters structure.
+ *
+ * @return A pointer to the newly created executor, or NULL if the creation fails.
+ */
+bcp_executor_t *bcp_executor_create(const bcp_executor_parm_t *executor_parm);
+
+/**
+ * @brief Destroys an executor.
+ *
+ * All the BCP blocks served by the executor must be destroyed before.
+ *
+ * @param executor A pointer to the executor to be destroyed.
+ */
+void bcp_executor_destory(bcp_executor_t *executor);
+
+/**
+ * @brief Creates a slab shared by many BCP blocks.
+ *
+ * The slab owns one lock free pool per size class. BCP blocks created with
+ * this slab draw their frame and packet buffers from it instead of
+ * preallocating private pools, so idle blocks pin no buffer memory.
+ *
+ * @param slab_parm Pointer to the slab parameters structure.
+ *
+ * @return A pointer to the newly created slab, or NULL if the creation fails.
+ */
+bcp_slab_t *bcp_slab_create(const bcp_slab_parm_t *slab_parm);
+
+/**
+ * @brief Destroys a slab.
+ *
+ * All the BCP blocks using the slab must be destroyed before.
+ *
+ * @param slab A pointer to the slab to be destroyed.
+ */
+void bcp_slab_destory(bcp_slab_t *slab);
+
 /**
  * @brief Creates a BCP block object.
  *
@@ -294,6 +512,78 @@ void bcp_adapter_port_init(const bcp_adapter_port_t *bcp_adapter_port);
  */
 bcp_block_t *bcp_create(const bcp_parm_t *bcp_parm, const bcp_interface_t *bcp_interface, const void *user_data);
 
+/**
+ * @brief Computes the arena size needed by bcp_create_static.
+ *
+ * @param bcp_parm Pointer to the BCP parameters structure that will be passed
+ *                 to bcp_create_static.
+ *
+ * @return The exact number of bytes required, including the alignment slack
+ *         for an arbitrarily aligned arena.
+ */
+uint32_t bcp_arena_size(const bcp_parm_t *bcp_parm);
+
+/**
+ * @brief Creates a BCP block object in a caller provided arena.
+ *
+ * Same as bcp_create, but every buffer of the block, including the receive
+ * buffers that bcp_create allocates on each sync, is carved out of the arena.
+ * The block never calls bcp_malloc or bcp_free, neither here nor later.
+ * The receive buffers are sized for the own mtu * mfs_scale, so a peer
+ * announcing a larger frame size is refused. The arena must stay valid until
+ * bcp_destory returns, it is not freed by BCP.
+ *
+ * @param bcp_parm Pointer to the BCP parameters structure.
+ * @param bcp_interface Pointer to the BCP interface structure.
+ * @param user_data A pointer to user-defined data passed to the interface callbacks.
+ * @param arena Pointer to the caller provided memory.
+ * @param arena_size Size of the arena in bytes, at least bcp_arena_size(bcp_parm).
+ *
+ * @return A pointer to the newly created bcp_block_t object, or NULL if the creation fails.
+ */
+bcp_block_t *bcp_create_static(const bcp_parm_t *bcp_parm, const bcp_interface_t *bcp_interface, const void *user_data,
+                               void *arena, uint32_t arena_size);
+
+/**
+ * @brief Creates a table of BCP sessions in one contiguous allocation.
+ *
+ * Every session of the table gets a slot of bcp_arena_size bytes rounded
+ * up to a cache line, and is created in it as by bcp_create_static. A host
+ * serving many sessions then walks adjacent memory instead of scattered
+ * heap blocks. The sessions share bcp_parm, hibernation is not supported.
+ *
+ * @param bcp_parm Pointer to the BCP parameters used by every session of the table.
+ * @param session_num Number of slots of the table.
+ *
+ * @return A pointer to the new table, or NULL if the creation fails.
+ */
+bcp_table_t *bcp_table_create(const bcp_parm_t *bcp_parm, uint32_t session_num);
+
+/**
+ * @brief Creates a BCP block object in a slot of a session table.
+ *
+ * The slot is free again once its block is destroyed with bcp_destory.
+ *
+ * @param table Pointer to the session table.
+ * @param index Slot of the block, less than the session_num of the table.
+ * @param bcp_interface Pointer to the BCP interface structure.
+ * @param user_data A pointer to user-defined data passed to the interface callbacks.
+ *
+ * @return A pointer to the newly created bcp_block_t object, or NULL if the slot
+ *         is in use or the creation fails.
+ */
+bcp_block_t *bcp_table_block_create(bcp_table_t *table, uint32_t index, const bcp_interface_t *bcp_interface,
+                                    const void *user_data);
+
+/**
+ * @brief Destroys a session table.
+ *
+ * Destroys the blocks still living in the table, then releases its memory.
+ *
+ * @param table Pointer to the session table.
+ */
+void bcp_table_destory(bcp_table_t *table);
+
 /**
  * @brief Destroys a BCP block object.
  *
@@ -306,6 +596,18 @@ bcp_block_t *bcp_create(const bcp_parm_t *bcp_parm, const bcp_interface_t *bcp_i
  */
 void bcp_destory(bcp_block_t *bcp_block);
 
+/**
+ * @brief Gets the usage statistics of a private pool of a BCP block.
+ *
+ * @param bcp_block A pointer to the BCP block object.
+ * @param pool_id The pool to inspect.
+ * @param stats Filled with the statistics on success.
+ *
+ * @return 0 on success, a negative value if the pool id is invalid or the
+ *         block draws its memory from a shared slab.
+ */
+int32_t bcp_pool_stats_get(bcp_block_t *bcp_block, bcp_pool_id_t pool_id, bcp_pool_stats_t *stats);
+
 /**
  * @brief Opens the communication channel for the BCP block.
  *
@@ -338,6 +640,10 @@ int32_t bcp_open(bcp_block_t *bcp_block, void (*opened_cb)(const bcp_block_t *bc
  * @param data A pointer to the data buffer to be sent.
  * @param len The number of bytes in the data buffer to send.
  *
+ * With compression agreed the message is compressed on the calling thread.
+ * With aggregation agreed a short message may wait up to aggregate_ms to
+ * share a frame with the next ones.
+ *
  * @return 0 if the data was successfully queued for sending.
  *         A negative value if the sending operation failed to initiate
  *         (e.g., the channel is not open, invalid parameters, or no buffer
@@ -364,6 +670,59 @@ int32_t bcp_send(bcp_block_t *bcp_block, void *data, uint32_t len);
  */
 int32_t bcp_input(bcp_block_t *bcp_block, void *data, uint32_t len);
 
+/**
+ * @brief Inputs raw bytes received from a byte stream transport to the BCP block.
+ *
+ * This function is the byte stream counterpart of `bcp_input`, for transports
+ * such as UART that deliver arbitrary chunks instead of packets. The BCP block
+ * must be created with `byte_stream` set. Frames are delimited by the magic
+ * head and the length field and validated by their CRC before being processed,
+ * so after garbage or a corrupted frame the stream resynchronizes on the next
+ * valid frame. It must always be called from the same thread.
+ *
+ * @param bcp_block A pointer to the BCP block object that will process the input data.
+ * @param data A pointer to the buffer containing the received bytes.
+ * @param len The number of bytes received, which may be of any size.
+ *
+ * @return The number of bytes consumed. It is less than len when the BCP block
+ *         is busy and could not take a complete frame, the remaining bytes
+ *         should be input again later. A frame is never held back while all
+ *         the bytes are reported consumed.
+ *         A negative value if the input operation failed (e.g., BCP block is
+ *         not created in byte stream mode).
+ */
+int32_t bcp_input_stream(bcp_block_t *bcp_block, const void *data, uint32_t len);
+
+/**
+ * @brief Runs the pending events of a BCP block created in BCP_WORK_MODE_EXTERNAL.
+ *
+ * This function processes all the queued events and the expired timeouts of
+ * the BCP block on the calling thread, output and listener callbacks are
+ * invoked from it. It should be called when `event_notify` fires and when the
+ * time returned by `bcp_next_deadline_ms` has elapsed. It must not be called
+ * concurrently for the same BCP block.
+ *
+ * @param bcp_block A pointer to the BCP block object to process.
+ *
+ * @return The number of events processed, or a negative value if the BCP block
+ *         is not in BCP_WORK_MODE_EXTERNAL.
+ */
+int32_t bcp_process(bcp_block_t *bcp_block);
+
+/**
+ * @brief Gets the time left until the next timeout of a BCP block.
+ *
+ * In BCP_WORK_MODE_EXTERNAL timeouts are not driven by the adapter timer, the
+ * host should call `bcp_process` once this time has elapsed, e.g. by using it
+ * as the epoll_wait timeout.
+ *
+ * @param bcp_block A pointer to the BCP block object.
+ *
+ * @return The time in milliseconds until the next deadline, 0 if it has
+ *         already expired, or BCP_NO_DEADLINE if nothing is pending.
+ */
+uint32_t bcp_next_deadline_ms(bcp_block_t *bcp_block);
+
 #ifdef __cplusplus
 }
 #endif
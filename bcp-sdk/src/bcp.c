@@ -4,8 +4,12 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 #include "bcp.h"
+#include "bcp_crc.h"
+#include "bcp_aead.h"
+#include "bcp_lz.h"
 
 
 //---------------------------------------------------------------------
@@ -86,79 +90,338 @@ typedef struct node_head {
 #define BCP_FRAME_DATA_END              0x13
 #define BCP_FRAME_DATA_ACK              0x14
 #define BCP_FRAME_DATA_NACK             0x15
+#define BCP_FRAME_DATA_AGGREGATE        0x16    // small messages, each behind a length byte
+#define BCP_FRAME_LZ_RESET              0x17    // the receiver lost its dictionary, restart the encoder
 #define BCP_FRAME_SYNC_REQ              0x18
 #define BCP_FRAME_SYNC_ACK              0x1C
 
-typedef struct s_node_head {
-	struct s_node_head *next;
-} s_node_t;
-
+// Flags byte following the mfs in a SYNC_REQ and echoed by the SYNC_ACK.
+// Peers that do not offer anything keep the short frames of old.
+#define BCP_SYNC_FLAG_CRC32C            0x01
+#define BCP_SYNC_FLAG_AEAD              0x02    // followed by the salt of the sender
+#define BCP_SYNC_FLAG_INTEGRITY         0x04    // BCP_TRANSPORT_INTEGRITY
+#define BCP_SYNC_FLAG_RELIABLE          0x08    // BCP_TRANSPORT_RELIABLE
+#define BCP_SYNC_FLAG_LZ                0x10    // compression stage
+#define BCP_SYNC_FLAG_AGGREGATE         0x20    // small message aggregation
+#define BCP_SYNC_FLAG_WIDE              0x40    // 32 bit lengths, the high half of the mfs follows the salt
+
+// Once wide lengths are agreed the head of a data frame is followed by the
+// high half of the payload length. Without them frames stay below 64 KB.
+#define BCP_WIDE_LEN_LEN                2
+#define BCP_NARROW_FRAME_MAX            0xFFFF
+
+// An encrypted data frame carries the counter of its nonce after the head
+// and a tag in place of the crc.
+#define BCP_AEAD_SALT_LEN               8
+#define BCP_AEAD_SEQ_LEN                4
+#define BCP_AEAD_WINDOW                 64
+
+// Once compression is agreed every message starts with a byte telling
+// how the rest was sent.
+#define BCP_LZ_HEAD_LEN                 1
+#define BCP_LZ_MSG_PACKED               0x01
+#define BCP_LZ_MSG_RESET                0x80    // the dictionary restarts with this message
+
+// Longest message an aggregate frame carries, its length takes one byte.
+#define BCP_AGG_MSG_MAX                 255
+
+// Slots of the ring single packet messages are sent from, must be a power
+// of two.
+#ifndef BCP_FAST_SLOT_NUM
+#define BCP_FAST_SLOT_NUM               8
+#endif
+
+// Maximum number of events of one bcp processed per executor turn.
+#ifndef BCP_EXECUTOR_EVENT_BUDGET
+#define BCP_EXECUTOR_EVENT_BUDGET       16
+#endif
+
+// Events a bcp can hold per lane, must be a power of two.
+#ifndef BCP_EVENT_RING_SIZE
+#define BCP_EVENT_RING_SIZE             8
+#endif
+
+// Time a grown pool must stay mostly free before it gives a chunk back.
+#ifndef BCP_POOL_IDLE_MS
+#define BCP_POOL_IDLE_MS                5000
+#endif
+
+// Share of the memory budget that elastic pools may grow into, the rest
+// is kept for new blocks and receive buffers.
+#ifndef BCP_MEM_ELASTIC_PERCENT
+#define BCP_MEM_ELASTIC_PERCENT         80
+#endif
+
+// First capacity of a receive buffer, it doubles from there.
+#ifndef BCP_RX_BUF_MIN
+#define BCP_RX_BUF_MIN                  64
+#endif
+
+// Slots of the retransmission ring, at most half the fsn space.
+#ifndef BCP_RETX_RING_MAX
+#define BCP_RETX_RING_MAX               128
+#endif
+
+// Frames in flight at once. An ack covering all of them is fsn_diff ahead
+// of the oldest by their number, which must stay below 128 to be ordered.
+#define BCP_RETX_IN_FLIGHT_MAX          127
+
+// Alignment of every buffer carved out of a bcp arena.
+#ifndef BCP_ARENA_ALIGN
+#define BCP_ARENA_ALIGN                 8
+#endif
+
+// Cache line size the session state is laid out for.
+#ifndef BCP_CACHE_LINE
+#define BCP_CACHE_LINE                  64
+#endif
+
+// Maximum number of slices handed to output_batch at once.
+#ifndef BCP_OUTPUT_BATCH_MAX
+#define BCP_OUTPUT_BATCH_MAX            32
+#endif
+
+#define MEM_POOL_INDEX_NONE             0xFFFF
+#define MEM_POOL_TAG_STEP               0x10000u
+#define MEM_POOL_CHUNK_MAX              8
+
+// The free list head packs a 16 bit version tag above a 16 bit block index,
+// so a 32 bit compare and swap is enough to defeat ABA.
+// A pool is made of up to MEM_POOL_CHUNK_MAX chunks of block_num blocks.
+// The first chunk belongs to the creator of the pool, the others are
+// allocated on demand and released again once they sit idle.
+// A chunk holds the block payloads back to back, followed by an array of
+// 16 bit free list links. Blocks carry no header, their pool and index
+// follow from the address.
+// Every chunk keeps its own free list and getters take from the lowest
+// chunk first, so the last one empties as the load goes down.
 typedef struct mem_pool {                        
-    uint16_t block_size;
+    uint32_t block_size;
+    uint32_t block_stride;
     uint16_t block_num;  
-    uint8_t *head;
-    s_node_t pool_list;      
+    uint8_t *chunks[MEM_POOL_CHUNK_MAX];
+    _Atomic uint32_t chunk_num;         // chunks allocated, a retired one until it is released
+    _Atomic uint32_t chunk_live;        // chunks getters take blocks from
+    uint32_t chunk_max;
+    uint32_t idle_since_ms;
+    _Atomic uint32_t resizing;          // held by a grow or a trim, changes of chunk_num and chunk_live
+    _Atomic uint32_t getters;           // callers inside a pop from a grown chunk
+    _Atomic uint32_t free_top[MEM_POOL_CHUNK_MAX];
+    _Atomic uint32_t chunk_in_use[MEM_POOL_CHUNK_MAX];  // blocks out per grown chunk
+
+    // stats
+    _Atomic uint32_t in_use;
+    _Atomic uint32_t high_watermark;
+    _Atomic uint32_t alloc_fail;
+    uint32_t grow_count;
+    uint32_t shrink_count;
 } mem_pool_t;
 
-typedef struct {                        
-    s_node_t block_node;       
-    mem_pool_t *mem_pool;     
-    uint8_t *data;             
-} mem_block_t;
-
+// The metadata stays in front of the payload. A frame carries it from
+// bcp_send through retx_wait before it owns a ring slot, and the ring is
+// released on an ACK without reading any frame, only a resend reads it,
+// right next to the payload it sends.
 typedef struct {
     queue_node_t node;                                                       
-    uint16_t frame_len;
+    uint32_t frame_len;
     uint16_t fsn;
+    uint32_t crc_weight;                // weight of the fsn byte in the crc, built-in engine only
+    uint8_t crc_len;                    // trailer the frame was sealed with
+    uint8_t seal_gen;                   // aead_session_t.tx_gen of the tag, encrypted frames only
+    uint8_t wide;                       // the head carries the high half of the length
     uint8_t frame_data[1];                     
 } frame_t;
 
+// Encrypted frame mode. The nonce of a data frame is the salt of its
+// sender followed by the counter the frame carries, a salt is drawn once
+// per BCP block so counters never repeat under the key. The SYNC exchange
+// is not authenticated, so the receiver draws a bind for every new peer
+// salt and returns it in the SYNC_ACK. The sender puts it in the associated
+// data, and frames recorded before a SYNC fail the tag afterwards.
+typedef struct {
+    uint8_t key[BCP_AEAD_KEY_LEN];
+    uint8_t tx_salt[BCP_AEAD_SALT_LEN];
+    uint8_t rx_salt[BCP_AEAD_SALT_LEN];
+    uint8_t tx_bind[2][BCP_AEAD_SALT_LEN]; // bind of the peer, the slot tx_gen & 1 is current
+    _Atomic uint8_t tx_gen;             // bumped by the worker for every bind received
+    uint8_t rx_bind[BCP_AEAD_SALT_LEN]; // own bind, the frames received are sealed with
+    _Atomic uint32_t tx_seq;            // next counter, taken by the sending threads
+    uint8_t rx_seen;                    // a frame under rx_salt has been accepted
+    uint32_t rx_top;                    // highest accepted counter
+    uint32_t rx_last;                   // counter of the last accepted frame
+    uint64_t rx_window;                 // bit n is set once rx_top - n has been accepted
+    bcp_aead_t rx;                      // frame being received
+} aead_session_t;
+
+// Compression stage. Each end keeps a dictionary of the messages it sent
+// and one of those it received, both only touched in message order: the
+// encoder by the thread calling bcp_send, the decoder by the worker.
+// The encoder and both buffers sit with the private pools and go while the
+// session sleeps, the next message sent restarts the dictionary. The peer
+// may still refer to the received one, which stays.
+typedef struct {
+    bcp_lz_enc_t *enc;
+    bcp_lz_dict_t rx;
+    _Atomic uint8_t on;                 // agreed at SYNC
+    _Atomic uint8_t tx_reset;           // the next message restarts the dictionary
+    uint8_t rx_lost;                    // a message was dropped, wait for a restart
+    uint8_t *tx_buf;                    // mal + BCP_LZ_HEAD_LEN bytes, the message as sent
+    uint8_t *rx_buf;                    // mal bytes, the message as received
+} lz_session_t;
+
 typedef struct {                                           
     uint16_t data_len;
     uint8_t data[1];                     
 } mtu_t;
 
+typedef struct {
+    uint32_t size;
+    void *context;
+    void (*event_handler)(bcp_t *bcp, const void *context);
+} bcp_context_t;
+
+// A cell is free for the producer holding ticket t when seq == t, and
+// holds an event for the consumer when seq == t + 1.
+typedef struct {
+    _Atomic uint32_t seq;
+    bcp_context_t bcp_context;
+} event_cell_t;
+
+typedef struct {
+    _Atomic uint32_t head;
+    uint32_t tail;
+    event_cell_t cells[BCP_EVENT_RING_SIZE];
+} event_ring_t;
+
+typedef enum {
+    BCP_EVENT_LANE_PRIOR = 0,
+    BCP_EVENT_LANE_NORMAL,
+    BCP_EVENT_LANE_NUM,
+} bcp_event_lane_t;
+
+typedef enum {
+    BCP_SESSION_ACTIVE = 0,
+    BCP_SESSION_DRAINING,               // the worker checks whether it may hibernate
+    BCP_SESSION_ASLEEP,
+    BCP_SESSION_WAKING,                 // a caller inflates the session again
+} bcp_session_state_t;
+
 typedef enum {
     BCP_STOP = 0,
     BCP_HANDSHAKE,
     BCP_DONE,
 } bcp_work_status_t;
 
-struct _bcp_t {                      
-    uint16_t mtu;                                
-    uint16_t mfs;                               
-	uint32_t mal;	
-    
+// The fields are grouped by who touches them and how often. The hot part
+// is read and written by the worker for every frame and opens the
+// struct, so a session starts on a cache line of its own. The fields
+// written by application threads follow on their own lines, and the
+// setup, pool and teardown state comes last.
+struct _bcp_t {
+    // hot, per frame
+    uint8_t status;
+    uint8_t snd_next;
+    uint8_t rcv_next;
+    uint8_t recv_frame_flag;
+    uint32_t recv_frame_offset;
+    uint32_t recv_frame_len;
+    uint32_t recv_app_data_offset;
+    uint32_t recv_frame_crc;            // running crc of the received part, built-in engine only
+    uint32_t mfs;
+    uint32_t peer_mfs;
+    uint32_t mal;
+    uint32_t mal_buf_size;              // capacity, grown on demand up to mal
+    uint32_t mfs_buf_size;              // capacity, grown on demand up to peer_mfs
     uint8_t *mal_buf;
     uint8_t *mfs_buf;
-    mem_pool_t frame_mem_pool; 
-    mem_pool_t mtu_mem_pool;
-    mem_pool_t snd_list_pool;
-    queue_node_t ack_list;
-  
-    uint8_t snd_next;                              
-    uint8_t rcv_next;   
-    
-    uint8_t exit_cmd;
-    uint8_t exit_flag;
 
-    uint8_t status;
-    uint8_t recv_frame_flag;
-    uint16_t recv_frame_offset;
-    uint16_t recv_frame_len;
-    uint16_t recv_app_data_offset;
+    // frames waiting for an ack, kept in the slot fsn & retx_mask
+    frame_t **retx_ring;
+    uint16_t retx_mask;
+    uint16_t retx_count;
+    uint16_t mtu;
+    uint8_t retx_head;                  // fsn of the oldest retained frame
+    uint8_t work_mode;
+    _Atomic uint8_t crc_len;            // crc trailer of data frames, agreed at SYNC
+    uint8_t sync_offer;                 // BCP_SYNC_FLAG_* of this end
+    _Atomic uint8_t link_caps;          // bcp_transport_cap_t both ends declared, agreed at SYNC
+    uint8_t recv_trailer_len;           // trailer of the frame being received
+    uint8_t recv_msg_lost;              // a message lost frames or its buffer, skip to the next message
+    _Atomic uint8_t wide_len;           // data frames carry 32 bit lengths, agreed at SYNC
+    aead_session_t *aead;               // NULL unless data frames are encrypted
+
+    bcp_slab_t *slab;
+    void *owner;
+    int32_t (*output)(const bcp_block_t *bcp_block, void *data, uint32_t len);
+    int32_t (*output_batch)(const bcp_block_t *bcp_block, const bcp_slice_t *slices, uint32_t count, uint32_t seg_size);
+    void (*data_listener)(const bcp_block_t *bcp_block, void *data, uint32_t len);
 
+    // shared with the application threads
+    _Alignas(BCP_CACHE_LINE) event_ring_t event_ring[BCP_EVENT_LANE_NUM];
+    _Atomic uint32_t worker_parked;
+    _Atomic uint8_t session_state;
+    _Atomic uint32_t session_users;
+    _Atomic uint32_t last_active_ms;
+    _Atomic uint32_t slab_used;
+
+    // byte stream deframer, run by the thread calling bcp_input_stream
+    uint32_t stream_head;
+    uint32_t stream_len;
+    uint32_t stream_sent;
+    uint8_t *stream_buf;
+
+    lz_session_t *lz;                   // NULL unless compression is offered
+
+    // small messages coalesced into one frame, run by the worker
+    _Atomic uint16_t agg_max;           // longest message aggregated, 0 until agreed at SYNC
+    uint16_t agg_cap;                   // payload of a frame sent in one packet
+    uint16_t agg_len;
+    uint16_t agg_count;
+    uint16_t agg_ms;                    // coalescing window, 0 when not offered
+    uint8_t agg_timer_on;               // the executor timer ticks for the window
+    uint32_t agg_deadline_ms;
+    uint8_t *agg_buf;                   // agg_cap bytes of length prefixed messages
+    frame_t *agg_frame;                 // carrier kept to send them in
+
+    // single packet messages, sent without snd_list or frame pool blocks
+    uint8_t *fast_slots;                // BCP_FAST_SLOT_NUM frames of fast_stride bytes
+    uint16_t fast_stride;
+    _Atomic uint32_t fast_head;         // next slot tried by a sender
+    _Atomic uint8_t fast_busy[BCP_FAST_SLOT_NUM];
+
+    // executor scheduling, protected by critical_section
+    bcp_executor_t *executor;
+    uint8_t scheduled;
+    int32_t pending_events;
+
+    // cold, setup, timers, pools and teardown
+    _Alignas(BCP_CACHE_LINE) uint8_t exit_cmd;
+    uint8_t exit_flag;
+    _Atomic uint8_t deadline_active;    // written by the worker, read by the timer thread
+    uint8_t static_mem;
+    uint32_t deadline_ms;
     uint32_t sync_timeout_ms;
+    uint32_t hibernate_ms;
+    uint32_t slab_quota;
+
+    uint8_t *heap_mem;
+    uint32_t heap_size;
+    uint8_t *pool_mem;                  // private pools kept apart to be released on hibernation
+    uint32_t pool_mem_size;
+    queue_node_t retx_wait;             // frames held back while the retransmission ring is full
+    mem_pool_t frame_mem_pool; 
+    mem_pool_t mtu_mem_pool;
+    mem_pool_t snd_list_pool;
 
-    void *queue;
+    bcp_thread_config_t work_thread_config;
+    void *wake_queue;
+    void *session_gate;                 // a token for every DRAINING or WAKING state left
     void *work_thread;
     void *timer;
     void *critical_section;
-    void *owner;
 
-    int32_t (*output)(const bcp_block_t *bcp_block, void *data, uint32_t len);
-    void (*data_listener)(const bcp_block_t *bcp_block, void *data, uint32_t len);
     void (*opened_listener)(const bcp_block_t *bcp_block, bcp_open_status_t status);
+    void (*event_notify)(const bcp_block_t *bcp_block);
 };
 
 typedef struct {
@@ -169,16 +432,133 @@ typedef struct {
 } bcp_frame_head_t;
 
 typedef struct {
-    uint32_t size;
-    void *context;
-    void (*event_handler)(bcp_t *bcp, const void *context);
-} bcp_context_t;
+    uint32_t count;
+    bcp_slice_t slices[BCP_OUTPUT_BATCH_MAX];
+} output_batch_t;
+
+typedef struct {
+    bcp_executor_t *executor;
+    void *thread;
+} executor_worker_t;
+
+struct _bcp_slab_t {
+    uint32_t class_num;
+    mem_pool_t *pools;
+};
+
+// Sessions of a table sit back to back in one allocation, each slot is
+// a static arena starting on a cache line.
+struct _bcp_table_t {
+    bcp_parm_t bcp_parm;
+    uint32_t session_num;
+    uint32_t slot_size;
+    uint32_t mem_size;
+    uint8_t *slots;
+    bcp_block_t **blocks;
+};
+
+struct _bcp_executor_t {
+    uint32_t thread_num;
+    uint32_t exit_num;
+    uint32_t session_num;               // sessions the run queue has room for
+    uint32_t session_count;             // sessions attached, protected by critical_section
+    void *run_queue;
+    void *critical_section;
+    executor_worker_t *workers;
+};
 
 static bcp_adapter_port_t bcp_adapter;
 
+// The adapter crc16_cal overrides the built-in engine when set.
+static uint16_t bcp_crc16(const void *data, uint32_t len)
+{
+    if (bcp_adapter.bcp_crc.crc16_cal != NULL) {
+        return bcp_adapter.bcp_crc.crc16_cal((void *)data, len);
+    }
+    return bcp_crc16_update(0, data, len);
+}
+
+// Data frames carry the crc agreed at SYNC. Over a transport that keeps
+// packets intact it is left out as long as a lost slice cannot go
+// unnoticed, on a reliable link or for a frame sent in one packet. The
+// other frames always carry a CRC-16.
+static uint8_t data_crc_len(bcp_t *bcp, uint32_t body_len)
+{
+    uint8_t caps = atomic_load_explicit(&bcp->link_caps, memory_order_relaxed);
+    if ((caps & BCP_TRANSPORT_INTEGRITY) && ((caps & BCP_TRANSPORT_RELIABLE) || body_len <= bcp->mtu)) {
+        return 0;
+    }
+    return atomic_load_explicit(&bcp->crc_len, memory_order_relaxed);
+}
+
+static uint32_t crc_trailer_get(const uint8_t *trailer, uint8_t crc_len)
+{
+    uint32_t crc = 0;
+    for (uint8_t i = crc_len; i > 0; i--) {
+        crc = crc << 8 | trailer[i - 1];
+    }
+    return crc;
+}
+
+static void crc_trailer_put(uint8_t *trailer, uint32_t crc, uint8_t crc_len)
+{
+    for (uint8_t i = 0; i < crc_len; i++) {
+        trailer[i] = (uint8_t)(crc >> (8 * i));
+    }
+}
+
+static uint32_t frame_crc(const uint8_t *data, uint32_t len, uint8_t crc_len)
+{
+    return crc_len == 4 ? bcp_crc32c_update(0, data, len) : bcp_crc16(data, len);
+}
+
+static bool frame_type_is_data(uint8_t frame_type)
+{
+    return (frame_type >= BCP_FRAME_DATA_COMPLETE && frame_type <= BCP_FRAME_DATA_END) ||
+           frame_type == BCP_FRAME_DATA_AGGREGATE;
+}
+
+// Bytes in front of the payload of a data frame.
+static uint8_t data_head_len(const bcp_t *bcp)
+{
+    uint8_t len = sizeof(bcp_frame_head_t);
+    if (atomic_load_explicit(&bcp->wide_len, memory_order_relaxed)) {
+        len += BCP_WIDE_LEN_LEN;
+    }
+    return bcp->aead != NULL ? len + BCP_AEAD_SEQ_LEN : len;
+}
+
+// Head and trailer of a data frame sent, room for the longer head and
+// trailer is kept while wide lengths or CRC-32C may still be agreed.
+static uint8_t data_frame_extra(const bcp_t *bcp)
+{
+    uint8_t head_len = sizeof(bcp_frame_head_t) + ((bcp->sync_offer & BCP_SYNC_FLAG_WIDE) ? BCP_WIDE_LEN_LEN : 0);
+    if (bcp->aead != NULL) {
+        return head_len + BCP_AEAD_SEQ_LEN + BCP_AEAD_TAG_LEN;
+    }
+    return head_len + ((bcp->sync_offer & BCP_SYNC_FLAG_CRC32C) ? 4 : 2);
+}
+
+// Bytes behind the payload of a received data frame. A frame sent in one
+// packet is told by its first slice holding all of it but the trailer.
+static uint8_t recv_trailer_len(bcp_t *bcp, uint32_t body_len, uint16_t slice_len)
+{
+    if (bcp->aead != NULL) {
+        return BCP_AEAD_TAG_LEN;
+    }
+
+    uint8_t caps = atomic_load_explicit(&bcp->link_caps, memory_order_relaxed);
+    if ((caps & BCP_TRANSPORT_INTEGRITY) && ((caps & BCP_TRANSPORT_RELIABLE) || slice_len == body_len)) {
+        return 0;
+    }
+    return atomic_load_explicit(&bcp->crc_len, memory_order_relaxed);
+}
+
 void bcp_adapter_port_init(const bcp_adapter_port_t *bcp_adapter_port)
 {
+    bcp_crc_init();
     bcp_adapter.bcp_crc.crc16_cal = bcp_adapter_port->bcp_crc.crc16_cal;
+    bcp_adapter.bcp_random.random_fill = bcp_adapter_port->bcp_random.random_fill;
 
     bcp_adapter.bcp_critical.critical_section_create = bcp_adapter_port->bcp_critical.critical_section_create;
     bcp_adapter.bcp_critical.critical_section_destory = bcp_adapter_port->bcp_critical.critical_section_destory;
@@ -208,223 +588,1521 @@ void bcp_adapter_port_init(const bcp_adapter_port_t *bcp_adapter_port)
 }
 
 
-static int8_t fsn_diff(uint8_t later, uint8_t earlier) {
-    return ((int8_t)(later - earlier));
+//---------------------------------------------------------------------
+// memory governor
+//---------------------------------------------------------------------
+typedef enum {
+    BCP_MEM_ESSENTIAL = 0,          // block arenas, receive buffers and slabs
+    BCP_MEM_ELASTIC,                // pool growth, refused first
+} bcp_mem_class_t;
+
+// Process wide view of the heap memory held by all bcp blocks.
+static struct {
+    _Atomic uint32_t budget;
+    _Atomic uint32_t used;
+    _Atomic uint32_t peak;
+    _Atomic uint32_t refused;
+} bcp_governor;
+
+void bcp_mem_budget_set(uint32_t budget)
+{
+    atomic_store(&bcp_governor.budget, budget);
 }
 
-int32_t mem_pool_init(mem_pool_t *mem_pool, uint32_t block_size, uint32_t block_num)
+void bcp_mem_stats_get(bcp_mem_stats_t *stats)
 {
-    mem_pool->block_size = block_size;
-    mem_pool->block_num = block_num;
-    mem_pool->pool_list.next = NULL;
-    mem_pool->head = NULL;
+    stats->budget = atomic_load(&bcp_governor.budget);
+    stats->used = atomic_load(&bcp_governor.used);
+    stats->peak = atomic_load(&bcp_governor.peak);
+    stats->refused = atomic_load(&bcp_governor.refused);
+}
 
-    uint32_t total_size = (sizeof(mem_block_t) + block_size) * block_num;
-    mem_pool->head = (uint8_t *)bcp_adapter.bcp_mem.bcp_malloc(total_size);
-    if (mem_pool->head == NULL) {
-        return -1;
+static int32_t governor_charge(uint32_t size, bcp_mem_class_t mem_class)
+{
+    uint32_t budget = atomic_load_explicit(&bcp_governor.budget, memory_order_relaxed);
+    uint32_t limit = budget;
+    if (budget != 0 && mem_class == BCP_MEM_ELASTIC) {
+        limit = (uint32_t)((uint64_t)budget * BCP_MEM_ELASTIC_PERCENT / 100);
     }
-   
-    uint8_t *ptr = mem_pool->head;
-    memset(ptr, 0, total_size);
-    mem_block_t *mem_block;
-    for (uint32_t i = 0; i < block_num; i++) {
-        mem_block = (mem_block_t *)ptr;
-        mem_block->block_node.next = mem_pool->pool_list.next;
-        mem_pool->pool_list.next = &mem_block->block_node;
-        mem_block->mem_pool = mem_pool;
-        mem_block->data = ptr + sizeof(mem_block_t);
-        ptr += block_size + sizeof(mem_block_t);
+
+    uint32_t used = atomic_load_explicit(&bcp_governor.used, memory_order_relaxed);
+    do {
+        if (budget != 0 && (size > limit || used > limit - size)) {
+            atomic_fetch_add_explicit(&bcp_governor.refused, 1, memory_order_relaxed);
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&bcp_governor.used, &used, used + size,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    uint32_t peak = atomic_load_explicit(&bcp_governor.peak, memory_order_relaxed);
+    while (used + size > peak &&
+           !atomic_compare_exchange_weak_explicit(&bcp_governor.peak, &peak, used + size,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
     }
 
     return 0;
 }
 
+// Heap allocations of bcp blocks go through the governor, which refuses
+// them once the budget would be exceeded.
+static void *bcp_mem_alloc(uint32_t size, bcp_mem_class_t mem_class)
+{
+    if (governor_charge(size, mem_class) != 0) {
+        return NULL;
+    }
 
-int32_t mem_pool_deinit(mem_pool_t *mem_pool)
+    void *ptr = bcp_adapter.bcp_mem.bcp_malloc(size);
+    if (ptr == NULL) {
+        atomic_fetch_sub_explicit(&bcp_governor.used, size, memory_order_relaxed);
+    }
+    return ptr;
+}
+
+static void bcp_mem_release(void *ptr, uint32_t size)
 {
-    bcp_adapter.bcp_mem.bcp_free(mem_pool->head);  
-    mem_pool->head = NULL;
-    mem_pool->block_size = 0;
-    mem_pool->block_num = 0;
-    mem_pool->pool_list.next = NULL;
+    if (ptr == NULL) {
+        return;
+    }
 
-    return 0;
+    bcp_adapter.bcp_mem.bcp_free(ptr);
+    atomic_fetch_sub_explicit(&bcp_governor.used, size, memory_order_relaxed);
 }
 
-void *mem_get_from_pool(bcp_t *bcp, mem_pool_t *mem_pool)
+// Makes room for need bytes in a receive buffer, keeping the first keep
+// bytes. The capacity doubles up to limit, so a session only holds what
+// its largest message needs. A static arena is sized for the limit.
+static int32_t rx_buf_reserve(bcp_t *bcp, uint8_t **buf, uint32_t *size, uint32_t need, uint32_t keep, uint32_t limit)
 {
-    void *ptr = NULL;
+    if (need <= *size) {
+        return 0;
+    }
 
-    if (bcp == NULL || mem_pool == NULL) {
-        return ptr;
+    if (bcp->static_mem || need > limit) {
+        return -1;
     }
 
-    bcp_adapter.bcp_critical.enter_critical_section(&bcp->critical_section);
+    uint32_t new_size = *size > 0 ? *size * 2 : BCP_RX_BUF_MIN;
+    new_size = new_size < need ? need : new_size;
+    new_size = new_size > limit ? limit : new_size;
 
-    if (mem_pool->pool_list.next != NULL) {
-        mem_block_t *block = queue_entry(mem_pool->pool_list.next, mem_block_t, block_node);
-        mem_pool->pool_list.next = block->block_node.next;
-        block->block_node.next = NULL;
-        ptr = block->data;
+    uint8_t *new_buf = (uint8_t *)bcp_mem_alloc(new_size, BCP_MEM_ESSENTIAL);
+    if (new_buf == NULL) {
+        return -1;
     }
 
-    bcp_adapter.bcp_critical.leave_critical_section(&bcp->critical_section);
+    if (keep > 0) {
+        memcpy(new_buf, *buf, keep);
+    }
+    bcp_mem_release(*buf, *size);
+    *buf = new_buf;
+    *size = new_size;
 
-    return ptr;
+    return 0;
 }
 
-void mem_free_to_pool(bcp_t *bcp, void *mem)
+static void rx_bufs_release(bcp_t *bcp)
 {
-    bcp_adapter.bcp_critical.enter_critical_section(&bcp->critical_section);
+    bcp_mem_release(bcp->mfs_buf, bcp->mfs_buf_size);
+    bcp->mfs_buf = NULL;
+    bcp->mfs_buf_size = 0;
+    bcp_mem_release(bcp->mal_buf, bcp->mal_buf_size);
+    bcp->mal_buf = NULL;
+    bcp->mal_buf_size = 0;
+}
 
-    mem_block_t *block = (mem_block_t *)((uint8_t *)mem - sizeof(mem_block_t));
-    mem_pool_t *mem_pool = block->mem_pool;
-    block->block_node.next = mem_pool->pool_list.next;
-    mem_pool->pool_list.next = &block->block_node;
+static int8_t fsn_diff(uint8_t later, uint8_t earlier) {
+    return ((int8_t)(later - earlier));
+}
 
-    bcp_adapter.bcp_critical.leave_critical_section(&bcp->critical_section);
+static uint8_t *mem_block_data(const mem_pool_t *mem_pool, uint16_t index)
+{
+    if (index < mem_pool->block_num) {
+        return mem_pool->chunks[0] + (uint32_t)index * mem_pool->block_stride;
+    }
+
+    uint8_t *chunk = mem_pool->chunks[index / mem_pool->block_num];
+    return chunk + (uint32_t)(index % mem_pool->block_num) * mem_pool->block_stride;
 }
 
-//---------------------------------------------------------------------
-// log            
-//---------------------------------------------------------------------
-static void (*k_log_hook)(bcp_log_level_t, const char *) = NULL;
-static bcp_log_level_t bcp_log_level = BCP_LOG_WARN;
+static _Atomic uint16_t *mem_block_next(const mem_pool_t *mem_pool, uint16_t index)
+{
+    uint8_t *chunk = mem_pool->chunks[index / mem_pool->block_num];
+    _Atomic uint16_t *links = (_Atomic uint16_t *)(chunk + (uint32_t)mem_pool->block_num * mem_pool->block_stride);
+    return &links[index % mem_pool->block_num];
+}
 
-void bcp_log_output_register(void (*log_output)(bcp_log_level_t level, const char *message)) 
+// Finds the index of the block holding mem, MEM_POOL_INDEX_NONE if mem
+// is not from this pool.
+static uint16_t mem_block_index(const mem_pool_t *mem_pool, const void *mem)
 {
-    k_log_hook = log_output;
+    // a retired chunk is still searched, a late getter may hold a block of it
+    uint32_t chunk_bytes = (uint32_t)mem_pool->block_num * mem_pool->block_stride;
+    uint32_t chunk_num = atomic_load_explicit(&mem_pool->chunk_num, memory_order_acquire);
+
+    for (uint32_t i = 0; i < chunk_num; i++) {
+        const uint8_t *chunk = mem_pool->chunks[i];
+        if ((const uint8_t *)mem >= chunk && (const uint8_t *)mem < chunk + chunk_bytes) {
+            return (uint16_t)(i * mem_pool->block_num + ((const uint8_t *)mem - chunk) / mem_pool->block_stride);
+        }
+    }
+
+    return MEM_POOL_INDEX_NONE;
 }
 
-void bcp_log_level_set(bcp_log_level_t level) 
+static uint32_t mem_pool_block_stride(uint32_t block_size)
 {
-    bcp_log_level = level;
+    // keep every payload pointer aligned
+    uint32_t align = sizeof(void *);
+    return (block_size + align - 1) & ~(align - 1);
 }
 
-static void k_log(bcp_log_level_t level, const char *format, ...) 
+uint32_t mem_pool_mem_size(uint32_t block_size, uint32_t block_num)
 {
+    return (mem_pool_block_stride(block_size) + sizeof(uint16_t)) * block_num;
+}
 
-    if (level > bcp_log_level) {
-        return;
+// Links the blocks of a chunk in address order and makes them its free list.
+static void mem_pool_chunk_format(mem_pool_t *mem_pool, uint8_t chunk)
+{
+    uint16_t first = chunk * mem_pool->block_num;
+
+    memset(mem_pool->chunks[chunk], 0, mem_pool_mem_size(mem_pool->block_size, mem_pool->block_num));
+    for (uint32_t i = 0; i < mem_pool->block_num; i++) {
+        uint16_t next = (i + 1 < mem_pool->block_num) ? (uint16_t)(first + i + 1) : MEM_POOL_INDEX_NONE;
+        atomic_init(mem_block_next(mem_pool, first + i), next);
     }
-    
-    char buf[100];
 
-    va_list ap;
-    va_start(ap, format);
-    vsnprintf(buf, 100, format, ap);
-    va_end(ap);
-    
-    if (k_log_hook) {
-        k_log_hook(level, buf);
-    } else {
-        printf("bcp log level : %d", level);
-        printf("%s\n", buf);
+    uint32_t top = atomic_load_explicit(&mem_pool->free_top[chunk], memory_order_relaxed);
+    atomic_store_explicit(&mem_pool->free_top[chunk], ((top + MEM_POOL_TAG_STEP) & ~0xFFFFu) | first,
+                          memory_order_release);
+    atomic_store_explicit(&mem_pool->chunk_in_use[chunk], 0, memory_order_relaxed);
+}
+
+// Lays the pool out on mem, which must hold mem_pool_mem_size bytes and
+// stays owned by the caller. With chunk_max > 1 the pool may grow up to
+// chunk_max * block_num blocks.
+int32_t mem_pool_init_on(mem_pool_t *mem_pool, uint32_t block_size, uint32_t block_num,
+                         uint32_t chunk_max, uint8_t *mem)
+{
+    memset(mem_pool, 0, sizeof(mem_pool_t));
+    mem_pool->block_size = block_size;
+    mem_pool->block_num = block_num;
+    mem_pool->block_stride = mem_pool_block_stride(block_size);
+    mem_pool->chunks[0] = mem;
+    atomic_init(&mem_pool->chunk_num, 1);
+    atomic_init(&mem_pool->chunk_live, 1);
+    mem_pool->chunk_max = chunk_max;
+    atomic_init(&mem_pool->resizing, 0);
+    atomic_init(&mem_pool->getters, 0);
+    for (uint32_t i = 0; i < MEM_POOL_CHUNK_MAX; i++) {
+        atomic_init(&mem_pool->free_top[i], MEM_POOL_INDEX_NONE);
+        atomic_init(&mem_pool->chunk_in_use[i], 0);
     }
+    atomic_init(&mem_pool->in_use, 0);
+    atomic_init(&mem_pool->high_watermark, 0);
+    atomic_init(&mem_pool->alloc_fail, 0);
+
+    if (chunk_max == 0 || chunk_max > MEM_POOL_CHUNK_MAX || block_num * chunk_max >= MEM_POOL_INDEX_NONE) {
+        return -1;
+    }
+
+    if (block_num == 0) {
+        return 0;
+    }
+
+    mem_pool_chunk_format(mem_pool, 0);
+
+    return 0;
 }
 
-static int32_t bcp_event_post(bcp_t *bcp,
-                            void *context,
-                            void (*context_handler)(bcp_t *bcp, const void *context)) 
+int32_t mem_pool_init(mem_pool_t *mem_pool, uint32_t block_size, uint32_t block_num)
 {
+    if (block_num >= MEM_POOL_INDEX_NONE) {
+        return -1;
+    }
 
-    bcp_context_t bcp_context;
-    bcp_context.context = context;
-    bcp_context.event_handler = context_handler;
+    uint8_t *mem = NULL;
+    if (block_num > 0) {
+        mem = (uint8_t *)bcp_mem_alloc(mem_pool_mem_size(block_size, block_num), BCP_MEM_ESSENTIAL);
+        if (mem == NULL) {
+            return -1;
+        }
+    }
 
-    return bcp_adapter.bcp_queue.queue_send(&bcp->queue, &bcp_context, sizeof(bcp_context), 0);  
+    return mem_pool_init_on(mem_pool, block_size, block_num, 1, mem);
 }
 
+// Releases the chunks grown on demand, the first chunk stays with its owner.
+static void mem_pool_chunks_free(mem_pool_t *mem_pool)
+{
+    uint32_t chunk_size = mem_pool_mem_size(mem_pool->block_size, mem_pool->block_num);
+    for (uint32_t i = 1; i < mem_pool->chunk_num; i++) {
+        bcp_mem_release(mem_pool->chunks[i], chunk_size);
+        mem_pool->chunks[i] = NULL;
+        atomic_store(&mem_pool->free_top[i], MEM_POOL_INDEX_NONE);
+    }
+    atomic_store(&mem_pool->chunk_num, 1);
+    atomic_store(&mem_pool->chunk_live, 1);
+}
 
-static int32_t bcp_event_post_prior(bcp_t *bcp,
-                            void *context,
-                            void (*context_handler)(bcp_t *bcp, const void *context)) 
+int32_t mem_pool_deinit(mem_pool_t *mem_pool)
 {
-    bcp_context_t bcp_context;
-    bcp_context.context = context;
-    bcp_context.event_handler = context_handler;
+    mem_pool_chunks_free(mem_pool);
+    bcp_mem_release(mem_pool->chunks[0], mem_pool_mem_size(mem_pool->block_size, mem_pool->block_num));
+    mem_pool->chunks[0] = NULL;
+    mem_pool->block_size = 0;
+    mem_pool->block_num = 0;
+    mem_pool->block_stride = 0;
+    atomic_store(&mem_pool->free_top[0], MEM_POOL_INDEX_NONE);
 
-    return bcp_adapter.bcp_queue.queue_send_prior(&bcp->queue, &bcp_context, sizeof(bcp_context), 0);  
+    return 0;
 }
 
+// Lays a pool whose chunks were all released out on fresh memory again,
+// the stats survive.
+static void mem_pool_attach(mem_pool_t *mem_pool, uint8_t *mem)
+{
+    mem_pool->chunks[0] = mem;
+    atomic_store(&mem_pool->chunk_num, 1);
+    atomic_store(&mem_pool->chunk_live, 1);
+    mem_pool->idle_since_ms = 0;
 
-static void bcp_thread_handler(void *arg)
+    if (mem_pool->block_num > 0) {
+        mem_pool_chunk_format(mem_pool, 0);
+    } else {
+        atomic_store(&mem_pool->free_top[0], MEM_POOL_INDEX_NONE);
+    }
+}
+
+// Pushes one block on the free list of its chunk.
+static void mem_pool_push(mem_pool_t *mem_pool, uint16_t index)
 {
-    bcp_t *bcp = (bcp_t *)arg;
+    _Atomic uint32_t *free_top = &mem_pool->free_top[index / mem_pool->block_num];
+    _Atomic uint16_t *next = mem_block_next(mem_pool, index);
+    uint32_t top = atomic_load_explicit(free_top, memory_order_relaxed);
+    uint32_t new_top;
+    do {
+        atomic_store_explicit(next, (uint16_t)(top & 0xFFFF), memory_order_relaxed);
+        new_top = ((top + MEM_POOL_TAG_STEP) & ~0xFFFFu) | index;
+    } while (!atomic_compare_exchange_weak_explicit(free_top, &top, new_top,
+                                                    memory_order_release, memory_order_relaxed));
+}
 
+// Pops a block off the free list of chunk, MEM_POOL_INDEX_NONE if it is empty.
+static uint16_t mem_pool_pop(mem_pool_t *mem_pool, uint32_t chunk)
+{
+    _Atomic uint32_t *free_top = &mem_pool->free_top[chunk];
+    uint32_t top = atomic_load_explicit(free_top, memory_order_acquire);
     while (1) {
-        bcp_context_t bcp_context;
-        if (bcp_adapter.bcp_queue.queue_recv(&bcp->queue, &bcp_context, sizeof(bcp_context_t), 0xffff) == 0) {
-            if (bcp_context.event_handler) {
-                bcp_context.event_handler(bcp, bcp_context.context);
-            } 
+        uint16_t index = (uint16_t)(top & 0xFFFF);
+        if (index == MEM_POOL_INDEX_NONE) {
+            return MEM_POOL_INDEX_NONE;
         }
 
-        if (bcp->exit_cmd != 0) {
-            break;
+        uint16_t next = atomic_load_explicit(mem_block_next(mem_pool, index), memory_order_relaxed);
+        uint32_t new_top = ((top + MEM_POOL_TAG_STEP) & ~0xFFFFu) | next;
+        if (atomic_compare_exchange_weak_explicit(free_top, &top, new_top,
+                                                  memory_order_acquire, memory_order_acquire)) {
+            return index;
         }
-    }  
-
-    bcp->exit_flag = 1;
-    bcp_adapter.bcp_thread.thread_exit(&bcp->work_thread);
+    }
 }
 
+// Adds one chunk, or takes a retired one back into service. Returns 0 when
+// the pool may have blocks again, including when another caller is
+// resizing it right now.
+static int32_t mem_pool_grow(mem_pool_t *mem_pool)
+{
+    if (mem_pool->block_num == 0 || atomic_load(&mem_pool->chunk_live) >= mem_pool->chunk_max) {
+        return -1;
+    }
 
+    if (atomic_exchange_explicit(&mem_pool->resizing, 1, memory_order_acquire) != 0) {
+        return 0;
+    }
 
-static void sync_frame_timeout_handle(bcp_t *bcp, const void *context)
-{
-    if (bcp->opened_listener) {
-        bcp_block_t *bcp_block = (bcp_block_t *)bcp->owner;
-        bcp->opened_listener(bcp_block, BCP_OPEND_ERROR_RSP_TIMEOUT);
+    int32_t ret = -1;
+    uint32_t chunk = atomic_load(&mem_pool->chunk_live);
+    if (chunk < atomic_load(&mem_pool->chunk_num)) {
+        // its free list and the blocks late getters took from it are intact
+        atomic_store(&mem_pool->chunk_live, chunk + 1);
+        mem_pool->grow_count++;
+        ret = 0;
+    } else if (chunk < mem_pool->chunk_max) {
+        uint8_t *mem = (uint8_t *)bcp_mem_alloc(mem_pool_mem_size(mem_pool->block_size, mem_pool->block_num), BCP_MEM_ELASTIC);
+        if (mem != NULL) {
+            mem_pool->chunks[chunk] = mem;
+            mem_pool_chunk_format(mem_pool, (uint8_t)chunk);
+            atomic_store(&mem_pool->chunk_num, chunk + 1);
+            atomic_store(&mem_pool->chunk_live, chunk + 1);
+            mem_pool->grow_count++;
+            ret = 0;
+        }
     }
+
+    atomic_store_explicit(&mem_pool->resizing, 0, memory_order_release);
+    return ret;
 }
 
-static void bcp_timer_tomeout_handler(void *arg)
+// Releases a retired chunk once it is quiet: no block of it is out, and
+// no getter is inside a pop that may still read one of its links. A getter
+// entering after the chunk left chunk_live does not see it any more.
+// Called with resizing held.
+static void mem_pool_retired_release(mem_pool_t *mem_pool)
 {
-    bcp_t *bcp = (bcp_t *)arg;
-    bcp_adapter.bcp_timer.timer_stop(&bcp->timer);
-    bcp_event_post_prior(bcp, NULL, sync_frame_timeout_handle);  
+    uint32_t chunk = atomic_load(&mem_pool->chunk_live);
+    if (chunk >= atomic_load(&mem_pool->chunk_num) ||
+        atomic_load(&mem_pool->getters) != 0 || atomic_load(&mem_pool->chunk_in_use[chunk]) != 0) {
+        return;
+    }
+
+    uint8_t *mem = mem_pool->chunks[chunk];
+    atomic_store(&mem_pool->chunk_num, chunk);
+    atomic_store(&mem_pool->free_top[chunk], MEM_POOL_INDEX_NONE);
+    mem_pool->chunks[chunk] = NULL;
+    bcp_mem_release(mem, mem_pool_mem_size(mem_pool->block_size, mem_pool->block_num));
 }
 
-static void sync_frame_send_handle(bcp_t *bcp, const void *context)
+// Retires the last chunk once the pool stayed below its low watermark for
+// BCP_POOL_IDLE_MS, i.e. half a chunk would still be free without the last
+// chunk, and none of its blocks is out. Only called by the context running
+// the bcp.
+static void mem_pool_trim(mem_pool_t *mem_pool, uint32_t now_ms)
 {
-    frame_t *sync_frame = (frame_t *)mem_get_from_pool(bcp, &bcp->mtu_mem_pool);
-    if (sync_frame == NULL) {
-        k_log(BCP_LOG_ERROR, "bcp sync send, sync mem get failed\n");
-
-        if (bcp->opened_listener) {
-            bcp_block_t *bcp_block = (bcp_block_t *)bcp->owner;
-            bcp->opened_listener(bcp_block, BCP_OPEND_ERROR_MEM_FAIL);
+    uint32_t live = atomic_load(&mem_pool->chunk_live);
+    if (live < atomic_load(&mem_pool->chunk_num)) {
+        if (atomic_exchange_explicit(&mem_pool->resizing, 1, memory_order_acquire) == 0) {
+            mem_pool_retired_release(mem_pool);
+            atomic_store_explicit(&mem_pool->resizing, 0, memory_order_release);
         }
         return;
     }
 
-    k_log(BCP_LOG_DEBUG, "bcp sync send, sync mem get ok\n");
+    if (live <= 1) {
+        return;
+    }
+
+    uint32_t capacity = live * mem_pool->block_num;
+    uint32_t in_use = atomic_load_explicit(&mem_pool->in_use, memory_order_relaxed);
+    if (in_use + mem_pool->block_num + mem_pool->block_num / 2 > capacity) {
+        mem_pool->idle_since_ms = 0;
+        return;
+    }
+
+    if (mem_pool->idle_since_ms == 0) {
+        mem_pool->idle_since_ms = now_ms | 1;
+        return;
+    }
+
+    if ((int32_t)(now_ms - mem_pool->idle_since_ms) < BCP_POOL_IDLE_MS ||
+        atomic_load(&mem_pool->chunk_in_use[live - 1]) != 0) {
+        return;
+    }
+    mem_pool->idle_since_ms = 0;
+
+    if (atomic_exchange_explicit(&mem_pool->resizing, 1, memory_order_acquire) != 0) {
+        return;
+    }
+
+    // a grow may have run since chunk_live was read
+    if (atomic_load(&mem_pool->chunk_live) == live && live == atomic_load(&mem_pool->chunk_num)) {
+        atomic_store(&mem_pool->chunk_live, live - 1);
+        mem_pool->shrink_count++;
+        mem_pool_retired_release(mem_pool);
+    }
+
+    atomic_store_explicit(&mem_pool->resizing, 0, memory_order_release);
+}
+
+
+// Lock free, callers on any thread may get and free blocks concurrently.
+void *mem_get_from_pool(bcp_t *bcp, mem_pool_t *mem_pool)
+{
+    if (bcp == NULL || mem_pool == NULL) {
+        return NULL;
+    }
+
+    uint16_t index = mem_pool_pop(mem_pool, 0);
+    if (index == MEM_POOL_INDEX_NONE && atomic_load_explicit(&mem_pool->chunk_live, memory_order_relaxed) > 1) {
+        // a grown chunk may be retired meanwhile, it is not released while
+        // a getter is counted here
+        atomic_fetch_add(&mem_pool->getters, 1);
+        uint32_t chunk_live = atomic_load(&mem_pool->chunk_live);
+        for (uint32_t i = 1; index == MEM_POOL_INDEX_NONE && i < chunk_live; i++) {
+            index = mem_pool_pop(mem_pool, i);
+            if (index != MEM_POOL_INDEX_NONE) {
+                atomic_fetch_add(&mem_pool->chunk_in_use[i], 1);
+            }
+        }
+        atomic_fetch_sub(&mem_pool->getters, 1);
+    }
+
+    if (index == MEM_POOL_INDEX_NONE) {
+        return NULL;
+    }
+
+    uint32_t in_use = atomic_fetch_add_explicit(&mem_pool->in_use, 1, memory_order_relaxed) + 1;
+    uint32_t high_watermark = atomic_load_explicit(&mem_pool->high_watermark, memory_order_relaxed);
+    while (in_use > high_watermark &&
+           !atomic_compare_exchange_weak_explicit(&mem_pool->high_watermark, &high_watermark, in_use,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+
+    return mem_block_data(mem_pool, index);
+}
+
+// The owner of a block is found by address, first among the private pools
+// of the bcp, then among the slab classes.
+static mem_pool_t *mem_pool_of(bcp_t *bcp, const void *mem, uint16_t *index)
+{
+    mem_pool_t *mem_pools[BCP_POOL_NUM] = {&bcp->frame_mem_pool, &bcp->mtu_mem_pool, &bcp->snd_list_pool};
+    for (uint32_t i = 0; i < BCP_POOL_NUM; i++) {
+        *index = mem_block_index(mem_pools[i], mem);
+        if (*index != MEM_POOL_INDEX_NONE) {
+            return mem_pools[i];
+        }
+    }
+
+    for (uint32_t i = 0; bcp->slab != NULL && i < bcp->slab->class_num; i++) {
+        *index = mem_block_index(&bcp->slab->pools[i], mem);
+        if (*index != MEM_POOL_INDEX_NONE) {
+            return &bcp->slab->pools[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Gives a fast path slot back, 0 if mem is not one.
+static uint8_t fast_slot_release(bcp_t *bcp, const void *mem)
+{
+    uintptr_t offset = (uintptr_t)mem - (uintptr_t)bcp->fast_slots;
+    if (offset >= (uintptr_t)bcp->fast_stride * BCP_FAST_SLOT_NUM) {
+        return 0;
+    }
+
+    atomic_store_explicit(&bcp->fast_busy[offset / bcp->fast_stride], 0, memory_order_release);
+    return 1;
+}
+
+void mem_free_to_pool(bcp_t *bcp, void *mem)
+{
+    if (fast_slot_release(bcp, mem)) {
+        return;
+    }
+
+    uint16_t index = MEM_POOL_INDEX_NONE;
+    mem_pool_t *mem_pool = mem_pool_of(bcp, mem, &index);
+    if (mem_pool == NULL) {
+        return;
+    }
+
+    // with a shared slab every block of the bcp is charged to its quota
+    if (bcp->slab != NULL) {
+        atomic_fetch_sub_explicit(&bcp->slab_used, mem_pool->block_size, memory_order_relaxed);
+    }
+
+    atomic_fetch_sub_explicit(&mem_pool->in_use, 1, memory_order_relaxed);
+    mem_pool_push(mem_pool, index);
+
+    // counted down only once the block no longer touches its chunk
+    uint32_t chunk = index / mem_pool->block_num;
+    if (chunk > 0) {
+        atomic_fetch_sub(&mem_pool->chunk_in_use[chunk], 1);
+    }
+}
+
+static void bcp_pools_trim(bcp_t *bcp)
+{
+    if (bcp->frame_mem_pool.chunk_max <= 1 && bcp->mtu_mem_pool.chunk_max <= 1) {
+        return;
+    }
+
+    uint32_t now_ms = bcp_adapter.bcp_time.get_ms();
+    mem_pool_trim(&bcp->frame_mem_pool, now_ms);
+    mem_pool_trim(&bcp->mtu_mem_pool, now_ms);
+}
+
+//---------------------------------------------------------------------
+// log            
+//---------------------------------------------------------------------
+static void (*k_log_hook)(bcp_log_level_t, const char *) = NULL;
+static bcp_log_level_t bcp_log_level = BCP_LOG_WARN;
+
+void bcp_log_output_register(void (*log_output)(bcp_log_level_t level, const char *message)) 
+{
+    k_log_hook = log_output;
+}
+
+void bcp_log_level_set(bcp_log_level_t level) 
+{
+    bcp_log_level = level;
+}
+
+static void k_log(bcp_log_level_t level, const char *format, ...) 
+{
+
+    if (level > bcp_log_level) {
+        return;
+    }
+    
+    char buf[100];
+
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(buf, 100, format, ap);
+    va_end(ap);
+    
+    if (k_log_hook) {
+        k_log_hook(level, buf);
+    } else {
+        printf("bcp log level : %d", level);
+        printf("%s\n", buf);
+    }
+}
+
+//---------------------------------------------------------------------
+// event ring
+//---------------------------------------------------------------------
+static void event_ring_init(event_ring_t *ring)
+{
+    atomic_init(&ring->head, 0);
+    ring->tail = 0;
+    for (uint32_t i = 0; i < BCP_EVENT_RING_SIZE; i++) {
+        atomic_init(&ring->cells[i].seq, i);
+    }
+}
+
+// Multi producer, any thread or isr may post.
+static int32_t event_ring_push(event_ring_t *ring, const bcp_context_t *bcp_context)
+{
+    uint32_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    while (1) {
+        event_cell_t *cell = &ring->cells[pos & (BCP_EVENT_RING_SIZE - 1)];
+        uint32_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        int32_t dif = (int32_t)(seq - pos);
+
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->bcp_context = *bcp_context;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (dif < 0) {
+            // ring full
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+}
+
+// Single consumer, only the context running the bcp may pop.
+static int32_t event_ring_pop(event_ring_t *ring, bcp_context_t *bcp_context)
+{
+    event_cell_t *cell = &ring->cells[ring->tail & (BCP_EVENT_RING_SIZE - 1)];
+    uint32_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    if (seq != ring->tail + 1) {
+        return -1;
+    }
+
+    *bcp_context = cell->bcp_context;
+    atomic_store_explicit(&cell->seq, ring->tail + BCP_EVENT_RING_SIZE, memory_order_release);
+    ring->tail++;
+
+    return 0;
+}
+
+static int32_t bcp_event_recv(bcp_t *bcp, bcp_context_t *bcp_context)
+{
+    if (event_ring_pop(&bcp->event_ring[BCP_EVENT_LANE_PRIOR], bcp_context) == 0) {
+        return 0;
+    }
+    return event_ring_pop(&bcp->event_ring[BCP_EVENT_LANE_NORMAL], bcp_context);
+}
+
+static uint8_t bcp_event_pending(bcp_t *bcp)
+{
+    for (uint32_t i = 0; i < BCP_EVENT_LANE_NUM; i++) {
+        event_ring_t *ring = &bcp->event_ring[i];
+        event_cell_t *cell = &ring->cells[ring->tail & (BCP_EVENT_RING_SIZE - 1)];
+        if (atomic_load_explicit(&cell->seq, memory_order_acquire) == ring->tail + 1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The work thread blocks on the wake queue only when both lanes are empty,
+// producers touch the adapter queue only to wake a parked worker.
+static void bcp_worker_park(bcp_t *bcp, uint32_t timeout_ms)
+{
+    atomic_store_explicit(&bcp->worker_parked, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (!bcp_event_pending(bcp)) {
+        uint8_t token;
+        bcp_adapter.bcp_queue.queue_recv(&bcp->wake_queue, &token, sizeof(token), timeout_ms);
+    }
+
+    atomic_store_explicit(&bcp->worker_parked, 0, memory_order_relaxed);
+}
+
+static void bcp_worker_wake(bcp_t *bcp)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&bcp->worker_parked, memory_order_relaxed) != 0 &&
+        atomic_exchange_explicit(&bcp->worker_parked, 0, memory_order_relaxed) != 0) {
+        // a stale token only causes one spurious wakeup
+        uint8_t token = 0;
+        bcp_adapter.bcp_queue.queue_send(&bcp->wake_queue, &token, sizeof(token), 0);
+    }
+}
+
+// Queues a scheduled bcp. Only a failing adapter queue refuses it, the bcp
+// is then left unscheduled and the next event queues it again.
+static void executor_enqueue(bcp_t *bcp)
+{
+    if (bcp_adapter.bcp_queue.queue_send(&bcp->executor->run_queue, &bcp, sizeof(bcp), 0) != 0) {
+        k_log(BCP_LOG_ERROR, "executor_enqueue, run queue send fail\n");
+        bcp_adapter.bcp_critical.enter_critical_section(&bcp->critical_section);
+        bcp->scheduled = 0;
+        bcp_adapter.bcp_critical.leave_critical_section(&bcp->critical_section);
+    }
+}
+
+// Counts a session in, the run queue holds one entry per session.
+static int32_t executor_attach(bcp_executor_t *executor)
+{
+    int32_t ret = -1;
+    bcp_adapter.bcp_critical.enter_critical_section(&executor->critical_section);
+    if (executor->session_count < executor->session_num) {
+        executor->session_count++;
+        ret = 0;
+    }
+    bcp_adapter.bcp_critical.leave_critical_section(&executor->critical_section);
+    return ret;
+}
+
+static void executor_detach(bcp_executor_t *executor)
+{
+    bcp_adapter.bcp_critical.enter_critical_section(&executor->critical_section);
+    executor->session_count--;
+    bcp_adapter.bcp_critical.leave_critical_section(&executor->critical_section);
+}
+
+static void executor_schedule(bcp_t *bcp)
+{
+    bcp_adapter.bcp_critical.enter_critical_section(&bcp->critical_section);
+    bcp->pending_events++;
+    uint8_t need_schedule = !bcp->scheduled;
+    bcp->scheduled = 1;
+    bcp_adapter.bcp_critical.leave_critical_section(&bcp->critical_section);
+
+    // A bcp is queued at most once, so the run queue never overflows.
+    if (need_schedule) {
+        executor_enqueue(bcp);
+    }
+}
+
+static void bcp_event_notify(bcp_t *bcp)
+{
+    if (bcp->work_mode == BCP_WORK_MODE_THREAD) {
+        bcp_worker_wake(bcp);
+    } else if (bcp->work_mode == BCP_WORK_MODE_EXTERNAL && bcp->event_notify) {
+        bcp->event_notify((bcp_block_t *)bcp->owner);
+    } else if (bcp->work_mode == BCP_WORK_MODE_EXECUTOR) {
+        executor_schedule(bcp);
+    }
+}
+
+static int32_t bcp_event_post(bcp_t *bcp,
+                            void *context,
+                            void (*context_handler)(bcp_t *bcp, const void *context)) 
+{
+
+    bcp_context_t bcp_context;
+    bcp_context.context = context;
+    bcp_context.event_handler = context_handler;
+
+    int32_t ret = event_ring_push(&bcp->event_ring[BCP_EVENT_LANE_NORMAL], &bcp_context);
+    if (ret == 0) {
+        bcp_event_notify(bcp);
+    }
+    return ret;
+}
+
+
+static int32_t bcp_event_post_prior(bcp_t *bcp,
+                            void *context,
+                            void (*context_handler)(bcp_t *bcp, const void *context)) 
+{
+    bcp_context_t bcp_context;
+    bcp_context.context = context;
+    bcp_context.event_handler = context_handler;
+
+    int32_t ret = event_ring_push(&bcp->event_ring[BCP_EVENT_LANE_PRIOR], &bcp_context);
+    if (ret == 0) {
+        bcp_event_notify(bcp);
+    }
+    return ret;
+}
+
+
+//---------------------------------------------------------------------
+// session hibernation
+//---------------------------------------------------------------------
+static void bcp_thread_handler(void *arg);
+static void bcp_timer_tomeout_handler(void *arg);
+static void bcp_pools_attach(bcp_t *bcp, uint8_t *mem);
+static void agg_flush(bcp_t *bcp);
+
+// In BCP_WORK_MODE_EXECUTOR the session timer ticks the idle check while
+// no handshake is running.
+static void session_idle_timer_start(bcp_t *bcp)
+{
+    if (bcp->work_mode == BCP_WORK_MODE_EXECUTOR && bcp->hibernate_ms != 0) {
+        bcp_adapter.bcp_timer.timer_start(&bcp->timer, bcp->hibernate_ms);
+    }
+}
+
+// An open aggregate takes the session timer over at its window, unless
+// a handshake holds it. sync_timer_stop hands it back.
+static void agg_timer_start(bcp_t *bcp)
+{
+    if (bcp->work_mode == BCP_WORK_MODE_EXECUTOR && !atomic_load(&bcp->deadline_active)) {
+        bcp->agg_timer_on = 1;
+        bcp_adapter.bcp_timer.timer_stop(&bcp->timer);
+        bcp_adapter.bcp_timer.timer_start(&bcp->timer, bcp->agg_ms);
+    }
+}
+
+static void agg_timer_resume(bcp_t *bcp)
+{
+    bcp->agg_timer_on = 0;
+    if (bcp->agg_len != 0) {
+        agg_timer_start(bcp);
+    }
+}
+
+static void agg_flush_due(bcp_t *bcp)
+{
+    if (bcp->agg_len != 0 && (int32_t)(bcp_adapter.bcp_time.get_ms() - bcp->agg_deadline_ms) >= 0) {
+        agg_flush(bcp);
+    }
+}
+
+// Milliseconds the worker may wait at most, shortened to the window of an
+// open aggregate.
+static uint32_t agg_wait_ms(bcp_t *bcp, uint32_t wait_ms)
+{
+    if (bcp->agg_len == 0) {
+        return wait_ms;
+    }
+
+    int32_t left = (int32_t)(bcp->agg_deadline_ms - bcp_adapter.bcp_time.get_ms());
+    left = left > 0 ? left : 0;
+    return (uint32_t)left < wait_ms ? (uint32_t)left : wait_ms;
+}
+
+static uint8_t bcp_session_idle_due(bcp_t *bcp)
+{
+    if (bcp->hibernate_ms == 0) {
+        return 0;
+    }
+
+    uint32_t idle_ms = bcp_adapter.bcp_time.get_ms() - atomic_load_explicit(&bcp->last_active_ms, memory_order_relaxed);
+    return idle_ms >= bcp->hibernate_ms;
+}
+
+// Milliseconds until the session is due for hibernation, at most 0xffff.
+static uint32_t bcp_session_idle_left(bcp_t *bcp)
+{
+    if (bcp->hibernate_ms == 0) {
+        return 0xffff;
+    }
+
+    uint32_t idle_ms = bcp_adapter.bcp_time.get_ms() - atomic_load_explicit(&bcp->last_active_ms, memory_order_relaxed);
+    uint32_t left = idle_ms < bcp->hibernate_ms ? bcp->hibernate_ms - idle_ms : 1;
+    return left > 0xffff ? 0xffff : left;
+}
+
+// Nothing may be in flight, every pool block is back and no message is
+// half received.
+static uint8_t bcp_session_quiet(bcp_t *bcp)
+{
+    if (atomic_load(&bcp->deadline_active) || bcp->retx_count != 0 ||
+        bcp->recv_frame_flag != 0 || bcp->recv_app_data_offset != 0) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < BCP_FAST_SLOT_NUM; i++) {
+        if (atomic_load(&bcp->fast_busy[i]) != 0) {
+            return 0;
+        }
+    }
+
+    return atomic_load(&bcp->frame_mem_pool.in_use) == 0 &&
+           atomic_load(&bcp->mtu_mem_pool.in_use) == 0 &&
+           atomic_load(&bcp->snd_list_pool.in_use) == 0 &&
+           atomic_load(&bcp->slab_used) == 0;
+}
+
+// Gives back the timer and the private pools. The state shared with the
+// peer stays: the received dictionary, and the AEAD salts and counters,
+// which must never repeat under the key.
+static void bcp_session_release(bcp_t *bcp)
+{
+    if (bcp->timer != NULL) {
+        bcp_adapter.bcp_timer.timer_stop(&bcp->timer);
+        bcp_adapter.bcp_timer.timer_destory(&bcp->timer);
+        bcp->timer = NULL;
+    }
+
+    if (bcp->static_mem) {
+        return;
+    }
+
+    mem_pool_chunks_free(&bcp->frame_mem_pool);
+    mem_pool_chunks_free(&bcp->mtu_mem_pool);
+    mem_pool_chunks_free(&bcp->snd_list_pool);
+    bcp_mem_release(bcp->pool_mem, bcp->pool_mem_size);
+    bcp->pool_mem = NULL;
+
+    // peer_mfs is kept, the buffers grow again with the next message
+    rx_bufs_release(bcp);
+}
+
+// Lets the callers waiting out a DRAINING or WAKING state look again, a
+// full gate holds the token already.
+static void session_gate_open(bcp_t *bcp)
+{
+    uint8_t token = 0;
+    bcp_adapter.bcp_queue.queue_send(&bcp->session_gate, &token, sizeof(token), 0);
+}
+
+// A token left from an earlier state is taken and waited past, one that
+// finds the state settled is handed on to the next waiter.
+static void session_gate_wait(bcp_t *bcp)
+{
+    uint8_t token;
+    if (bcp_adapter.bcp_queue.queue_recv(&bcp->session_gate, &token, sizeof(token), 0xffff) != 0) {
+        return;
+    }
+
+    uint8_t state = atomic_load(&bcp->session_state);
+    if (state == BCP_SESSION_ACTIVE || state == BCP_SESSION_ASLEEP) {
+        session_gate_open(bcp);
+    }
+}
+
+// Only called by the context running the bcp. In BCP_WORK_MODE_THREAD the
+// handle of the work thread is handed to the caller, which must exit.
+static uint8_t bcp_session_hibernate(bcp_t *bcp, void **work_thread)
+{
+    uint8_t state = BCP_SESSION_ACTIVE;
+    if (!atomic_compare_exchange_strong(&bcp->session_state, &state, BCP_SESSION_DRAINING)) {
+        return 0;
+    }
+
+    // pairs with the users increment in bcp_session_enter
+    if (atomic_load(&bcp->session_users) != 0 || bcp_event_pending(bcp) || !bcp_session_quiet(bcp)) {
+        atomic_store_explicit(&bcp->last_active_ms, bcp_adapter.bcp_time.get_ms(), memory_order_relaxed);
+        atomic_store(&bcp->session_state, BCP_SESSION_ACTIVE);
+        session_gate_open(bcp);
+        return 0;
+    }
+
+    bcp_session_release(bcp);
+    if (work_thread != NULL) {
+        *work_thread = bcp->work_thread;
+        bcp->work_thread = NULL;
+    }
+    k_log(BCP_LOG_INFO, "bcp hibernate, idle for %d ms\n", bcp->hibernate_ms);
+
+    atomic_store(&bcp->session_state, BCP_SESSION_ASLEEP);
+    session_gate_open(bcp);
+    return 1;
+}
+
+static int32_t bcp_session_resume(bcp_t *bcp)
+{
+    if (!bcp->static_mem) {
+        if (bcp->pool_mem_size > 0) {
+            bcp->pool_mem = (uint8_t *)bcp_mem_alloc(bcp->pool_mem_size, BCP_MEM_ESSENTIAL);
+            if (bcp->pool_mem == NULL) {
+                k_log(BCP_LOG_ERROR, "bcp resume, pool mem get fail\n");
+                goto pool_mem_fail;
+            }
+
+            bcp_pools_attach(bcp, bcp->pool_mem);
+        }
+    }
+
+    if (bcp_adapter.bcp_timer.timer_create(&bcp->timer, bcp_timer_tomeout_handler, bcp) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp resume, timer create failed\n");
+        bcp->timer = NULL;
+        goto resume_fail;
+    }
+
+    if (bcp->work_mode == BCP_WORK_MODE_THREAD &&
+        bcp_adapter.bcp_thread.thread_create(&bcp->work_thread, &bcp->work_thread_config) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp resume, work thread create failed\n");
+        goto resume_fail;
+    }
+    session_idle_timer_start(bcp);
+
+    k_log(BCP_LOG_INFO, "bcp resume ok\n");
+    return 0;
+
+resume_fail:
+    bcp_session_release(bcp);
+pool_mem_fail:
+    return -1;
+}
+
+// Keeps the session awake while a caller touches its pools and rings, a
+// hibernated session is inflated again first.
+static int32_t bcp_session_enter(bcp_t *bcp)
+{
+    if (bcp->hibernate_ms == 0) {
+        return 0;
+    }
+
+    while (1) {
+        atomic_fetch_add(&bcp->session_users, 1);
+        uint8_t state = atomic_load(&bcp->session_state);
+        if (state == BCP_SESSION_ACTIVE) {
+            atomic_store_explicit(&bcp->last_active_ms, bcp_adapter.bcp_time.get_ms(), memory_order_relaxed);
+            return 0;
+        }
+        atomic_fetch_sub(&bcp->session_users, 1);
+
+        if (state == BCP_SESSION_ASLEEP &&
+            atomic_compare_exchange_strong(&bcp->session_state, &state, BCP_SESSION_WAKING)) {
+            if (bcp_session_resume(bcp) != 0) {
+                atomic_store(&bcp->session_state, BCP_SESSION_ASLEEP);
+                session_gate_open(bcp);
+                return -1;
+            }
+            atomic_store_explicit(&bcp->last_active_ms, bcp_adapter.bcp_time.get_ms(), memory_order_relaxed);
+            atomic_store(&bcp->session_state, BCP_SESSION_ACTIVE);
+            session_gate_open(bcp);
+        } else if (state != BCP_SESSION_ASLEEP) {
+            // draining or being woken by another caller
+            session_gate_wait(bcp);
+        }
+    }
+}
+
+static void bcp_session_leave(bcp_t *bcp)
+{
+    if (bcp->hibernate_ms != 0) {
+        atomic_fetch_sub(&bcp->session_users, 1);
+    }
+}
+
+static void bcp_idle_check_handle(bcp_t *bcp, const void *context)
+{
+    (void)context;
+
+    if (bcp->agg_timer_on) {
+        agg_flush_due(bcp);
+        if (bcp->agg_len == 0) {
+            bcp->agg_timer_on = 0;
+            bcp_adapter.bcp_timer.timer_stop(&bcp->timer);
+            session_idle_timer_start(bcp);
+        }
+    }
+
+    if (bcp_session_idle_due(bcp)) {
+        bcp_session_hibernate(bcp, NULL);
+    }
+}
+
+static void bcp_thread_handler(void *arg)
+{
+    bcp_t *bcp = (bcp_t *)arg;
+
+    while (1) {
+        bcp_context_t bcp_context;
+        if (bcp_event_recv(bcp, &bcp_context) == 0) {
+            if (bcp_context.event_handler) {
+                bcp_context.event_handler(bcp, bcp_context.context);
+            } 
+        } else {
+            void *work_thread = NULL;
+            if (bcp_session_idle_due(bcp) && bcp_session_hibernate(bcp, &work_thread)) {
+                // the next caller spawns a new thread
+                bcp_adapter.bcp_thread.thread_exit(&work_thread);
+                return;
+            }
+            bcp_worker_park(bcp, agg_wait_ms(bcp, bcp_session_idle_left(bcp)));
+        }
+        agg_flush_due(bcp);
+        bcp_pools_trim(bcp);
+
+        if (bcp->exit_cmd != 0) {
+            break;
+        }
+    }  
+
+    bcp->exit_flag = 1;
+    bcp_adapter.bcp_thread.thread_exit(&bcp->work_thread);
+}
+
+// Runs a bounded number of events of a scheduled bcp, then either puts it
+// back to the run queue or marks it idle.
+static void executor_session_run(bcp_t *bcp)
+{
+    for (uint32_t i = 0; i < BCP_EXECUTOR_EVENT_BUDGET; i++) {
+        bcp_context_t bcp_context;
+        if (bcp_event_recv(bcp, &bcp_context) != 0) {
+            break;
+        }
+
+        if (bcp_context.event_handler) {
+            bcp_context.event_handler(bcp, bcp_context.context);
+        }
+
+        bcp_adapter.bcp_critical.enter_critical_section(&bcp->critical_section);
+        bcp->pending_events--;
+        bcp_adapter.bcp_critical.leave_critical_section(&bcp->critical_section);
+        bcp_pools_trim(bcp);
+
+        // Stay scheduled so that the bcp is never queued again.
+        if (bcp->exit_cmd != 0) {
+            bcp->exit_flag = 1;
+            return;
+        }
+    }
+
+    bcp_adapter.bcp_critical.enter_critical_section(&bcp->critical_section);
+    uint8_t requeue = bcp->pending_events > 0;
+    if (!requeue) {
+        bcp->scheduled = 0;
+    }
+    bcp_adapter.bcp_critical.leave_critical_section(&bcp->critical_section);
+
+    if (requeue) {
+        executor_enqueue(bcp);
+    }
+}
+
+static void bcp_executor_handler(void *arg)
+{
+    executor_worker_t *worker = (executor_worker_t *)arg;
+    bcp_executor_t *executor = worker->executor;
+
+    while (1) {
+        bcp_t *bcp = NULL;
+        if (bcp_adapter.bcp_queue.queue_recv(&executor->run_queue, &bcp, sizeof(bcp), 0xffff) != 0) {
+            continue;
+        }
+
+        // A NULL bcp is the exit command
+        if (bcp == NULL) {
+            break;
+        }
+        executor_session_run(bcp);
+    }
+
+    bcp_adapter.bcp_critical.enter_critical_section(&executor->critical_section);
+    executor->exit_num++;
+    bcp_adapter.bcp_critical.leave_critical_section(&executor->critical_section);
+    bcp_adapter.bcp_thread.thread_exit(&worker->thread);
+}
+
+bcp_executor_t *bcp_executor_create(const bcp_executor_parm_t *executor_parm)
+{
+    if (executor_parm->thread_num == 0 || executor_parm->session_num == 0) {
+        k_log(BCP_LOG_ERROR, "bcp executor create, invalid parm\n");
+        return NULL;
+    }
+
+    bcp_executor_t *executor = (bcp_executor_t *)bcp_adapter.bcp_mem.bcp_malloc(sizeof(bcp_executor_t));
+    if (executor == NULL) {
+        k_log(BCP_LOG_ERROR, "bcp executor create, executor get mem fail\n");
+        return NULL;
+    }
+
+    executor->thread_num = 0;
+    executor->exit_num = 0;
+    executor->session_num = executor_parm->session_num;
+    executor->session_count = 0;
+    executor->workers = (executor_worker_t *)bcp_adapter.bcp_mem.bcp_malloc(sizeof(executor_worker_t) * executor_parm->thread_num);
+    if (executor->workers == NULL) {
+        k_log(BCP_LOG_ERROR, "bcp executor create, workers get mem fail\n");
+        goto workers_mem_fail;
+    }
+
+    if (bcp_adapter.bcp_critical.critical_section_create(&executor->critical_section) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp executor create, critical create failed\n");
+        goto critical_create_fail;
+    }
+
+    // one more slot for each exit command
+    uint32_t item_num = executor_parm->session_num + executor_parm->thread_num;
+    if (bcp_adapter.bcp_queue.queue_create(&executor->run_queue, item_num, sizeof(bcp_t *)) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp executor create, run queue create failed\n");
+        goto run_queue_create_fail;
+    }
+
+    for (uint32_t i = 0; i < executor_parm->thread_num; i++) {
+        executor_worker_t *worker = &executor->workers[i];
+        worker->executor = executor;
+        bcp_thread_config_t thread_config = {
+            .thread_name = executor_parm->thread_name,
+            .thread_priority = executor_parm->thread_priority,
+            .thread_stack_size = executor_parm->thread_stack_size,
+            .thread_func = bcp_executor_handler,
+            .arg = worker,
+        };
+        if (bcp_adapter.bcp_thread.thread_create(&worker->thread, &thread_config) != 0) {
+            k_log(BCP_LOG_ERROR, "bcp executor create, worker thread create failed, index : %d\n", i);
+            bcp_executor_destory(executor);
+            return NULL;
+        }
+        executor->thread_num++;
+    }
+
+    k_log(BCP_LOG_TRACE, "bcp executor create successful\n");
+
+    return executor;
+
+run_queue_create_fail:
+    bcp_adapter.bcp_critical.critical_section_destory(&executor->critical_section);
+critical_create_fail:
+    bcp_adapter.bcp_mem.bcp_free(executor->workers);
+workers_mem_fail:
+    bcp_adapter.bcp_mem.bcp_free(executor);
+
+    return NULL;
+}
+
+void bcp_executor_destory(bcp_executor_t *executor)
+{
+    if (executor == NULL) {
+        k_log(BCP_LOG_INFO, "bcp_executor_destory, executor is null\n");
+        return;
+    }
+
+    bcp_t *exit_cmd = NULL;
+    for (uint32_t i = 0; i < executor->thread_num; i++) {
+        while (bcp_adapter.bcp_queue.queue_send(&executor->run_queue, &exit_cmd, sizeof(exit_cmd), 0) != 0) {
+            bcp_adapter.bcp_time.delay_ms(10);
+        }
+    }
+
+    while (1) {
+        bcp_adapter.bcp_critical.enter_critical_section(&executor->critical_section);
+        uint32_t exit_num = executor->exit_num;
+        bcp_adapter.bcp_critical.leave_critical_section(&executor->critical_section);
+        if (exit_num >= executor->thread_num) {
+            break;
+        }
+        bcp_adapter.bcp_time.delay_ms(10);
+    }
+
+    bcp_adapter.bcp_queue.queue_destory(&executor->run_queue);
+    bcp_adapter.bcp_critical.critical_section_destory(&executor->critical_section);
+    bcp_adapter.bcp_mem.bcp_free(executor->workers);
+    bcp_adapter.bcp_mem.bcp_free(executor);
+
+    k_log(BCP_LOG_INFO, "bcp_executor_destory ok\n");
+}
+
+
+
+//---------------------------------------------------------------------
+// slab
+//---------------------------------------------------------------------
+bcp_slab_t *bcp_slab_create(const bcp_slab_parm_t *slab_parm)
+{
+    if (slab_parm->classes == NULL || slab_parm->class_num == 0) {
+        k_log(BCP_LOG_ERROR, "bcp slab create, invalid parm\n");
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < slab_parm->class_num; i++) {
+        const bcp_slab_class_t *slab_class = &slab_parm->classes[i];
+        if (slab_class->block_size == 0 ||
+            (i > 0 && slab_class->block_size <= slab_parm->classes[i - 1].block_size)) {
+            k_log(BCP_LOG_ERROR, "bcp slab create, class %d must be larger than the previous one\n", i);
+            return NULL;
+        }
+    }
+
+    bcp_slab_t *slab = (bcp_slab_t *)bcp_adapter.bcp_mem.bcp_malloc(sizeof(bcp_slab_t));
+    if (slab == NULL) {
+        k_log(BCP_LOG_ERROR, "bcp slab create, slab get mem fail\n");
+        return NULL;
+    }
+
+    slab->class_num = 0;
+    slab->pools = (mem_pool_t *)bcp_adapter.bcp_mem.bcp_malloc(sizeof(mem_pool_t) * slab_parm->class_num);
+    if (slab->pools == NULL) {
+        k_log(BCP_LOG_ERROR, "bcp slab create, pools get mem fail\n");
+        goto pools_mem_fail;
+    }
+
+    for (uint32_t i = 0; i < slab_parm->class_num; i++) {
+        const bcp_slab_class_t *slab_class = &slab_parm->classes[i];
+        if (mem_pool_init(&slab->pools[i], slab_class->block_size, slab_class->block_num) < 0) {
+            k_log(BCP_LOG_ERROR, "bcp slab create, class %d init failed\n", i);
+            goto pool_init_fail;
+        }
+        slab->class_num++;
+    }
+
+    k_log(BCP_LOG_TRACE, "bcp slab create successful\n");
+
+    return slab;
+
+pool_init_fail:
+    for (uint32_t i = 0; i < slab->class_num; i++) {
+        mem_pool_deinit(&slab->pools[i]);
+    }
+    bcp_adapter.bcp_mem.bcp_free(slab->pools);
+pools_mem_fail:
+    bcp_adapter.bcp_mem.bcp_free(slab);
+
+    return NULL;
+}
+
+void bcp_slab_destory(bcp_slab_t *slab)
+{
+    if (slab == NULL) {
+        k_log(BCP_LOG_INFO, "bcp_slab_destory, slab is null\n");
+        return;
+    }
+
+    for (uint32_t i = 0; i < slab->class_num; i++) {
+        mem_pool_deinit(&slab->pools[i]);
+    }
+    bcp_adapter.bcp_mem.bcp_free(slab->pools);
+    bcp_adapter.bcp_mem.bcp_free(slab);
+
+    k_log(BCP_LOG_INFO, "bcp_slab_destory ok\n");
+}
+
+// Takes a block from the smallest class that fits and still has one,
+// charging the whole block to the quota of the bcp.
+static void *slab_get(bcp_t *bcp, uint32_t size)
+{
+    bcp_slab_t *slab = bcp->slab;
+
+    for (uint32_t i = 0; i < slab->class_num; i++) {
+        mem_pool_t *mem_pool = &slab->pools[i];
+        if (mem_pool->block_size < size) {
+            continue;
+        }
+
+        uint32_t used = atomic_fetch_add_explicit(&bcp->slab_used, mem_pool->block_size, memory_order_relaxed);
+        if (bcp->slab_quota != 0 && used + mem_pool->block_size > bcp->slab_quota) {
+            atomic_fetch_sub_explicit(&bcp->slab_used, mem_pool->block_size, memory_order_relaxed);
+            return NULL;
+        }
+
+        void *ptr = mem_get_from_pool(bcp, mem_pool);
+        if (ptr != NULL) {
+            return ptr;
+        }
+        atomic_fetch_sub_explicit(&bcp->slab_used, mem_pool->block_size, memory_order_relaxed);
+    }
+
+    return NULL;
+}
+
+// size is only used to pick a slab class, private pools have a fixed block size.
+static void *bcp_mem_get(bcp_t *bcp, mem_pool_t *mem_pool, uint32_t size)
+{
+    if (bcp->slab != NULL) {
+        return slab_get(bcp, size);
+    }
+
+    // a caller losing the race against another grow may come back empty,
+    // as at the ceiling
+    void *ptr = mem_get_from_pool(bcp, mem_pool);
+    if (ptr == NULL && mem_pool_grow(mem_pool) == 0) {
+        ptr = mem_get_from_pool(bcp, mem_pool);
+    }
+
+    if (ptr == NULL) {
+        atomic_fetch_add_explicit(&mem_pool->alloc_fail, 1, memory_order_relaxed);
+    }
+    return ptr;
+}
+
+
+
+static int32_t bcp_output(const bcp_t *bcp, void *data, uint32_t len)
+{
+    bcp_block_t *bcp_block = (bcp_block_t *)bcp->owner;
+    if (bcp->output) {
+        return bcp->output(bcp_block, data, len);
+    }
+
+    bcp_slice_t slice;
+    slice.data = data;
+    slice.len = len;
+    return bcp->output_batch(bcp_block, &slice, 1, 0);
+}
+
+static void sync_frame_timeout_handle(bcp_t *bcp, const void *context)
+{
+    session_idle_timer_start(bcp);
+    agg_timer_resume(bcp);
+
+    if (bcp->opened_listener) {
+        bcp_block_t *bcp_block = (bcp_block_t *)bcp->owner;
+        bcp->opened_listener(bcp_block, BCP_OPEND_ERROR_RSP_TIMEOUT);
+    }
+}
+
+static void bcp_timer_tomeout_handler(void *arg)
+{
+    bcp_t *bcp = (bcp_t *)arg;
+    // taken once, a sync_timer_stop racing the expiry wins or loses as a whole
+    if (!atomic_exchange(&bcp->deadline_active, 0)) {
+        bcp_event_post_prior(bcp, NULL, bcp_idle_check_handle);
+        return;
+    }
+
+    bcp_adapter.bcp_timer.timer_stop(&bcp->timer);
+    bcp_event_post_prior(bcp, NULL, sync_frame_timeout_handle);  
+}
+
+// In BCP_WORK_MODE_EXTERNAL the timeout is a deadline checked by bcp_process.
+static void sync_timer_start(bcp_t *bcp, uint32_t timeout_ms)
+{
+    if (bcp->work_mode == BCP_WORK_MODE_EXTERNAL) {
+        bcp->deadline_ms = bcp_adapter.bcp_time.get_ms() + timeout_ms;
+        atomic_store_explicit(&bcp->deadline_active, 1, memory_order_release);
+    } else {
+        atomic_store(&bcp->deadline_active, 1);
+        // the idle check may tick on the same timer
+        bcp_adapter.bcp_timer.timer_stop(&bcp->timer);
+        bcp_adapter.bcp_timer.timer_start(&bcp->timer, timeout_ms);
+    }
+}
+
+static void sync_timer_stop(bcp_t *bcp)
+{
+    atomic_store(&bcp->deadline_active, 0);
+    if (bcp->work_mode != BCP_WORK_MODE_EXTERNAL) {
+        bcp_adapter.bcp_timer.timer_stop(&bcp->timer);
+        session_idle_timer_start(bcp);
+        agg_timer_resume(bcp);
+    }
+}
+
+// The retained frames always hold consecutive fsns starting at retx_head,
+// so ACK and NACK only touch the frames they release or resend.
+static uint8_t retx_ring_full(const bcp_t *bcp)
+{
+    uint16_t slots = bcp->retx_mask + 1;
+    return bcp->retx_count >= (slots < BCP_RETX_IN_FLIGHT_MAX ? slots : BCP_RETX_IN_FLIGHT_MAX);
+}
+
+static void retx_ring_push(bcp_t *bcp, frame_t *frame)
+{
+    if (bcp->retx_count == 0) {
+        bcp->retx_head = frame->fsn;
+    }
+    bcp->retx_ring[frame->fsn & bcp->retx_mask] = frame;
+    bcp->retx_count++;
+}
+
+// Frees the oldest count retained frames.
+static void retx_ring_drop(bcp_t *bcp, uint16_t count)
+{
+    while (count-- > 0 && bcp->retx_count > 0) {
+        uint16_t slot = bcp->retx_head & bcp->retx_mask;
+        mem_free_to_pool(bcp, bcp->retx_ring[slot]);
+        bcp->retx_ring[slot] = NULL;
+        bcp->retx_head++;
+        bcp->retx_count--;
+    }
+}
+
+// Number of retained frames with an fsn before fsn.
+static uint16_t retx_ring_before(const bcp_t *bcp, uint8_t fsn)
+{
+    int8_t diff = fsn_diff(fsn, bcp->retx_head);
+    if (diff <= 0) {
+        return 0;
+    }
+    return (uint16_t)diff < bcp->retx_count ? (uint16_t)diff : bcp->retx_count;
+}
+
+static void sync_frame_send_handle(bcp_t *bcp, const void *context)
+{
+    uint32_t sync_size = sizeof(frame_t) + sizeof(bcp_frame_head_t) + sizeof(uint16_t) + 1 + BCP_AEAD_SALT_LEN +
+                         BCP_WIDE_LEN_LEN + 2;
+    frame_t *sync_frame = (frame_t *)bcp_mem_get(bcp, &bcp->mtu_mem_pool, sync_size);
+    if (sync_frame == NULL) {
+        k_log(BCP_LOG_ERROR, "bcp sync send, sync mem get failed\n");
+
+        if (bcp->opened_listener) {
+            bcp_block_t *bcp_block = (bcp_block_t *)bcp->owner;
+            bcp->opened_listener(bcp_block, BCP_OPEND_ERROR_MEM_FAIL);
+        }
+        return;
+    }
+
+    k_log(BCP_LOG_DEBUG, "bcp sync send, sync mem get ok\n");
+
+    if (retx_ring_full(bcp)) {
+        mem_free_to_pool(bcp, sync_frame);
+        k_log(BCP_LOG_ERROR, "bcp sync send, retransmission ring full\n");
+        if (bcp->opened_listener) {
+            bcp->opened_listener((bcp_block_t *)bcp->owner, BCP_OPEND_ERROR_MEM_FAIL);
+        }
+        return;
+    }
 
     uint8_t *ptr = sync_frame->frame_data;
     bcp_frame_head_t frame_head;
     frame_head.magic_head = BCP_MAGIC_HEAD;
     frame_head.ctrl = BCP_FRAME_SYNC_REQ;
     frame_head.fsn = bcp->snd_next++;
-    frame_head.len = sizeof(bcp->mfs);
+    uint8_t flags = bcp->sync_offer;
+    frame_head.len = sizeof(uint16_t) + (flags ? 1 : 0) + (bcp->aead != NULL ? BCP_AEAD_SALT_LEN : 0) +
+                     ((flags & BCP_SYNC_FLAG_WIDE) ? BCP_WIDE_LEN_LEN : 0);
     
     memcpy(ptr, &frame_head, sizeof(frame_head));
     ptr += sizeof(frame_head);
-    memcpy(ptr, &bcp->mfs, sizeof(bcp->mfs));
-    ptr += sizeof(bcp->mfs);
+    uint16_t mfs_low = bcp->mfs > BCP_NARROW_FRAME_MAX ? BCP_NARROW_FRAME_MAX : bcp->mfs;
+    *ptr++ = (uint8_t)mfs_low;
+    *ptr++ = (uint8_t)(mfs_low >> 8);
+    if (flags) {
+        *ptr++ = flags;
+    }
+    if (bcp->aead != NULL) {
+        memcpy(ptr, bcp->aead->tx_salt, BCP_AEAD_SALT_LEN);
+        ptr += BCP_AEAD_SALT_LEN;
+    }
+    if (flags & BCP_SYNC_FLAG_WIDE) {
+        *ptr++ = (uint8_t)(bcp->mfs >> 16);
+        *ptr++ = (uint8_t)(bcp->mfs >> 24);
+    }
 
-    uint16_t crc = bcp_adapter.bcp_crc.crc16_cal(sync_frame->frame_data, ptr - sync_frame->frame_data);
+    uint16_t crc = bcp_crc16(sync_frame->frame_data, ptr - sync_frame->frame_data);
     *ptr++ = (uint8_t)crc;
     *ptr++ = (uint8_t)(crc >> 8);
 
     k_log(BCP_LOG_DEBUG, "bcp sync send, crc : %04x\n", crc);
 
     sync_frame->frame_len = ptr - sync_frame->frame_data;
+    sync_frame->fsn = frame_head.fsn;
     queue_init(&sync_frame->node);
 
     bcp_block_t *bcp_block = (bcp_block_t *)bcp->owner;
-    if (bcp->output(bcp_block, sync_frame->frame_data, sync_frame->frame_len) != 0) {
+    if (bcp_output(bcp, sync_frame->frame_data, sync_frame->frame_len) != 0) {
         mem_free_to_pool(bcp, sync_frame);
         k_log(BCP_LOG_ERROR, "bcp sync send, send failed\n");
         if (bcp->opened_listener) {
@@ -433,45 +2111,272 @@ static void sync_frame_send_handle(bcp_t *bcp, const void *context)
         return;
     }
     
-    queue_add_tail(&sync_frame->node, &bcp->ack_list);
+    retx_ring_push(bcp, sync_frame);
     bcp->status = BCP_HANDSHAKE;
-    bcp_adapter.bcp_timer.timer_start(&bcp->timer, bcp->sync_timeout_ms);
+    sync_timer_start(bcp, bcp->sync_timeout_ms);
 }
 
-static void data_frame_pack(frame_t *frame, uint8_t *payload, uint32_t payload_len, uint32_t frame_type)
+// Writes the head of a data frame with fsn 0. In the wide length mode the
+// high half of the payload length follows it. Returns the bytes written.
+static uint8_t data_head_put(uint8_t *ptr, uint32_t frame_type, uint32_t payload_len, uint8_t wide)
 {
-    k_log(BCP_LOG_DEBUG, "data_frame_pack, payload_len is %d, frame_type is %d\n", payload_len, frame_type);
-    frame->frame_len = payload_len + 8;
-
-    uint8_t *ptr = frame->frame_data;
     bcp_frame_head_t frame_head;
     frame_head.magic_head = BCP_MAGIC_HEAD;
     frame_head.ctrl = frame_type;
-    frame_head.len = payload_len;
-    
+    frame_head.fsn = 0;
+    frame_head.len = (uint16_t)payload_len;
     memcpy(ptr, &frame_head, sizeof(frame_head));
-    ptr += sizeof(frame_head);
-    memcpy(ptr, payload, payload_len);
-    ptr += payload_len;
+    if (!wide) {
+        return sizeof(frame_head);
+    }
+
+    ptr[sizeof(frame_head)] = (uint8_t)(payload_len >> 16);
+    ptr[sizeof(frame_head) + 1] = (uint8_t)(payload_len >> 24);
+    return sizeof(frame_head) + BCP_WIDE_LEN_LEN;
+}
+
+static void data_frame_pack(frame_t *frame, uint8_t *payload, uint32_t payload_len, uint32_t frame_type, uint8_t crc_len,
+                            uint8_t wide)
+{
+    k_log(BCP_LOG_DEBUG, "data_frame_pack, payload_len is %d, frame_type is %d\n", payload_len, frame_type);
+    uint8_t *ptr = frame->frame_data;
+    uint8_t head_len = data_head_put(ptr, frame_type, payload_len, wide);
+    ptr += head_len;
+    frame->frame_len = head_len + payload_len + crc_len;
+    frame->crc_len = crc_len;
+    frame->wide = wide;
+
+    // checksummed on the sending thread with fsn 0, the worker patches the fsn in
+    uint32_t crc = 0;
+    if (crc_len == 4) {
+        crc = bcp_crc32c_update(0, frame->frame_data, head_len);
+        crc = bcp_crc32c_copy(crc, ptr, payload, payload_len);
+        frame->crc_weight = bcp_crc32c_weight(head_len - 4 + payload_len);
+    } else if (crc_len == 2 && bcp_adapter.bcp_crc.crc16_cal == NULL) {
+        crc = bcp_crc16_update(0, frame->frame_data, head_len);
+        crc = bcp_crc16_copy(crc, ptr, payload, payload_len);
+        frame->crc_weight = bcp_crc16_weight(head_len - 4 + payload_len);
+    } else {
+        memcpy(ptr, payload, payload_len);
+        return;
+    }
+    crc_trailer_put(ptr + payload_len, crc, crc_len);
+}
+
+static void store32_le(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t load32_le(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// The head without the fsn and the bind of the receiver are the associated
+// data, the fsn is only known on the worker and the counter orders the
+// frames instead. In the wide length mode the high half of the length is
+// part of the head. Returns the length of the associated data.
+static uint8_t aead_frame_aad(uint8_t *aad, const uint8_t *frame_data, uint8_t head_len, const uint8_t *bind)
+{
+    memcpy(aad, frame_data, head_len);
+    aad[3] = 0;
+    memcpy(aad + head_len, bind, BCP_AEAD_SALT_LEN);
+    return head_len + BCP_AEAD_SALT_LEN;
+}
+
+// Enciphers the payload straight from the application buffer into the
+// frame and authenticates it in the same pass, the tag replaces the crc.
+static void data_frame_encrypt(const aead_session_t *aead, frame_t *frame, uint8_t *payload, uint32_t payload_len,
+                               uint32_t frame_type, uint32_t seq, uint8_t wide)
+{
+    uint8_t *ptr = frame->frame_data;
+    uint8_t head_len = data_head_put(ptr, frame_type, payload_len, wide);
+    ptr += head_len;
+    store32_le(ptr, seq);
+    ptr += BCP_AEAD_SEQ_LEN;
+    frame->frame_len = head_len + BCP_AEAD_SEQ_LEN + payload_len + BCP_AEAD_TAG_LEN;
+    frame->crc_len = BCP_AEAD_TAG_LEN;
+    frame->wide = wide;
+
+    // the bind is written before tx_gen is bumped
+    uint8_t gen = atomic_load_explicit(&aead->tx_gen, memory_order_acquire);
+    frame->seal_gen = gen;
+
+    uint8_t nonce[BCP_AEAD_NONCE_LEN];
+    memcpy(nonce, aead->tx_salt, BCP_AEAD_SALT_LEN);
+    store32_le(nonce + BCP_AEAD_SALT_LEN, seq);
+    uint8_t aad[sizeof(bcp_frame_head_t) + BCP_WIDE_LEN_LEN + BCP_AEAD_SALT_LEN];
+    uint8_t aad_len = aead_frame_aad(aad, frame->frame_data, head_len, aead->tx_bind[gen & 1]);
+
+    bcp_aead_t ctx;
+    bcp_aead_start(&ctx, aead->key, nonce, aad, aad_len);
+    bcp_aead_encrypt(&ctx, ptr, payload, payload_len);
+    bcp_aead_finish(&ctx, ptr + payload_len);
+}
+
+// Takes count consecutive counters, refused once the counters under the
+// salt are used up.
+static int32_t aead_seq_take(aead_session_t *aead, uint32_t count, uint32_t *seq)
+{
+    uint32_t next = atomic_load_explicit(&aead->tx_seq, memory_order_relaxed);
+    do {
+        if (next > UINT32_MAX - count) {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&aead->tx_seq, &next, next + count,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    *seq = next;
+    return 0;
+}
+
+// Reads the payload length back from the head of a packed data frame.
+static uint32_t data_frame_payload_len(const frame_t *frame)
+{
+    const uint8_t *data = frame->frame_data;
+    uint32_t payload_len = data[4] | (uint32_t)data[5] << 8;
+    if (frame->wide) {
+        payload_len |= (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+    }
+    return payload_len;
+}
 
-    // temporary placeholder field
-    ptr += 2;
+// A frame sealed before a SYNC brought a new bind or a new head gets a new
+// tag, the cipher text stays as it is.
+static void aead_frame_reseal(aead_session_t *aead, frame_t *frame)
+{
+    uint8_t *data = frame->frame_data;
+    uint32_t payload_len = data_frame_payload_len(frame);
+    uint8_t head_len = sizeof(bcp_frame_head_t) + (frame->wide ? BCP_WIDE_LEN_LEN : 0);
+
+    uint8_t gen = atomic_load_explicit(&aead->tx_gen, memory_order_relaxed);
+    frame->seal_gen = gen;
+
+    uint8_t nonce[BCP_AEAD_NONCE_LEN];
+    memcpy(nonce, aead->tx_salt, BCP_AEAD_SALT_LEN);
+    memcpy(nonce + BCP_AEAD_SALT_LEN, data + head_len, BCP_AEAD_SEQ_LEN);
+    uint8_t aad[sizeof(bcp_frame_head_t) + BCP_WIDE_LEN_LEN + BCP_AEAD_SALT_LEN];
+    uint8_t aad_len = aead_frame_aad(aad, data, head_len, aead->tx_bind[gen & 1]);
+
+    uint8_t *text = data + head_len + BCP_AEAD_SEQ_LEN;
+    bcp_aead_t ctx;
+    bcp_aead_start(&ctx, aead->key, nonce, aad, aad_len);
+    bcp_aead_auth(&ctx, text, payload_len);
+    bcp_aead_finish(&ctx, text + payload_len);
+}
+
+// Moves everything behind the head for the head of the other length mode,
+// data_frame_extra keeps room for the longer one. Refused for a payload
+// the 16 bit length cannot carry.
+static int32_t data_frame_rehead(frame_t *frame, uint8_t wide)
+{
+    uint8_t *data = frame->frame_data;
+    uint32_t payload_len = data_frame_payload_len(frame);
+    if (!wide && payload_len > 0xFFFF) {
+        return -1;
+    }
+
+    uint8_t frame_type = data[2];
+    uint8_t old_head = sizeof(bcp_frame_head_t) + (frame->wide ? BCP_WIDE_LEN_LEN : 0);
+    uint32_t rest_len = frame->frame_len - old_head;
+    uint8_t new_head = sizeof(bcp_frame_head_t) + (wide ? BCP_WIDE_LEN_LEN : 0);
+    memmove(data + new_head, data + old_head, rest_len);
+    data_head_put(data, frame_type, payload_len, wide);
+    frame->frame_len = new_head + rest_len;
+    frame->wide = wide;
+    return 0;
 }
 
-static void data_frame_repack(bcp_t *bcp, frame_t *frame)
+// The fsn is only known on the worker. With the built-in engine the crc
+// of the frame is patched for it, which costs the same for any frame size.
+// A frame packed before the handshake settled the trailer or the length
+// mode is sealed again, bcp_send_post leaves room for the longer ones.
+static int32_t data_frame_repack(bcp_t *bcp, frame_t *frame)
 {
+    uint8_t reheaded = frame->wide != atomic_load_explicit(&bcp->wide_len, memory_order_relaxed);
+    if (reheaded && data_frame_rehead(frame, !frame->wide) != 0) {
+        return -1;
+    }
+
     uint8_t *ptr = frame->frame_data;
     ptr += 3;
     frame->fsn = bcp->snd_next++;
     *ptr = frame->fsn;
 
-    uint16_t crc = bcp_adapter.bcp_crc.crc16_cal(frame->frame_data, frame->frame_len - 2);
-    ptr = frame->frame_data;
-    ptr[frame->frame_len - 2] = crc;
-    ptr[frame->frame_len - 1] = crc >> 8;
+    // the fsn is left out of the tag, which only changes with the bind or the head
+    if (bcp->aead != NULL) {
+        if (reheaded || frame->seal_gen != atomic_load_explicit(&bcp->aead->tx_gen, memory_order_relaxed)) {
+            aead_frame_reseal(bcp->aead, frame);
+        }
+        return 0;
+    }
+
+    uint32_t body_len = frame->frame_len - frame->crc_len;
+    uint8_t crc_len = data_crc_len(bcp, body_len);
+    uint32_t crc = 0;
+    if (crc_len == 0) {
+        frame->frame_len = body_len;
+        frame->crc_len = 0;
+        return 0;
+    }
+    if (reheaded || frame->crc_len != crc_len || (crc_len == 2 && bcp_adapter.bcp_crc.crc16_cal != NULL)) {
+        frame->frame_len = body_len + crc_len;
+        frame->crc_len = crc_len;
+        crc = frame_crc(frame->frame_data, body_len, crc_len);
+    } else if (crc_len == 4) {
+        crc = crc_trailer_get(frame->frame_data + body_len, 4);
+        crc = bcp_crc32c_patch(crc, frame->fsn, frame->crc_weight);
+    } else {
+        crc = crc_trailer_get(frame->frame_data + body_len, 2);
+        crc = bcp_crc16_patch(crc, frame->fsn, frame->crc_weight);
+    }
+    crc_trailer_put(frame->frame_data + body_len, crc, crc_len);
+    return 0;
+}
+
+// Drops a waiting frame with the frames of its message behind it, returns
+// the entry that follows them.
+static frame_t *retx_wait_drop_message(bcp_t *bcp, frame_t *frame)
+{
+    do {
+        frame_t *next_frame = queue_entry(frame->node.next, frame_t, node);
+        queue_del(&frame->node);
+        mem_free_to_pool(bcp, frame);
+        frame = next_frame;
+    } while (&frame->node != &bcp->retx_wait &&
+             (frame->frame_data[2] == BCP_FRAME_DATA_MIDDLE || frame->frame_data[2] == BCP_FRAME_DATA_END));
+
+    return frame;
+}
+
+static void output_batch_flush(const bcp_t *bcp, output_batch_t *batch)
+{
+    if (batch->count == 0) {
+        return;
+    }
+
+    // The offload hint only holds for one contiguous run of full mtu slices.
+    uint32_t seg_size = batch->count > 1 ? bcp->mtu : 0;
+    for (uint32_t i = 0; i + 1 < batch->count && seg_size != 0; i++) {
+        const bcp_slice_t *slice = &batch->slices[i];
+        if (slice->len != bcp->mtu || (uint8_t *)slice->data + slice->len != batch->slices[i + 1].data) {
+            seg_size = 0;
+        }
+    }
+
+    k_log(BCP_LOG_DEBUG, "output_batch_flush, count is %d, seg_size is %d\n", batch->count, seg_size);
+
+    bcp_block_t *bcp_block = (bcp_block_t *)bcp->owner;
+    if (bcp->output_batch(bcp_block, batch->slices, batch->count, seg_size) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp output batch, output fail, count : %d\n", batch->count);
+    }
+    batch->count = 0;
 }
 
-static void data_frame_output(const bcp_t *bcp, const frame_t *frame)
+static void data_frame_output(const bcp_t *bcp, const frame_t *frame, output_batch_t *batch)
 {
     uint32_t count = (frame->frame_len + bcp->mtu - 1)/bcp->mtu;
 
@@ -479,12 +2384,17 @@ static void data_frame_output(const bcp_t *bcp, const frame_t *frame)
     frame->frame_len, frame->frame_data[3], count);
 
     uint8_t *data = (uint8_t *)frame->frame_data;
-    uint16_t frame_len = frame->frame_len;
-    bcp_block_t *bcp_block = (bcp_block_t *)bcp->owner;
+    uint32_t frame_len = frame->frame_len;
     while(count > 0) {
         uint16_t len = frame_len > bcp->mtu ? bcp->mtu : frame_len;
         k_log(BCP_LOG_DEBUG, "bcp output, fsn is %d, len is %d, count is %d\n", frame->frame_data[3], len, count);
-        if (bcp->output(bcp_block, data, len) != 0) {
+        if (batch != NULL) {
+            batch->slices[batch->count].data = data;
+            batch->slices[batch->count].len = len;
+            if (++batch->count == BCP_OUTPUT_BATCH_MAX) {
+                output_batch_flush(bcp, batch);
+            }
+        } else if (bcp_output(bcp, data, len) != 0) {
             k_log(BCP_LOG_ERROR, "bcp output, output fail, frame_len : %d, fsn : %d\n", frame->frame_len, frame->fsn);
         }
         data += len;
@@ -493,20 +2403,151 @@ static void data_frame_output(const bcp_t *bcp, const frame_t *frame)
     }
 }
 
+// Sends the waiting frames in order, as many as the ring has room for.
+// The rest goes out once acks free their slots.
+static void retx_wait_flush(bcp_t *bcp)
+{
+    output_batch_t batch;
+    batch.count = 0;
+    output_batch_t *out_batch = bcp->output_batch ? &batch : NULL;
+
+    frame_t *frame = NULL, *next_frame = NULL;
+    LIST_FOR_EACH_ENTRY_SAFE(frame, next_frame, &bcp->retx_wait, frame_t, node) {
+        // more frames in flight than fsns to tell them apart
+        if (retx_ring_full(bcp)) {
+            k_log(BCP_LOG_DEBUG, "retx_wait_flush, retransmission ring full, count : %d\n", bcp->retx_count);
+            break;
+        }
+        if (data_frame_repack(bcp, frame) != 0) {
+            // only a new peer without wide lengths gets here
+            k_log(BCP_LOG_ERROR, "retx_wait_flush, frame too long for the peer, message dropped\n");
+            next_frame = retx_wait_drop_message(bcp, frame);
+            continue;
+        }
+        queue_del(&frame->node);
+
+        data_frame_output(bcp, frame, out_batch);
+        retx_ring_push(bcp, frame);
+
+        // nothing is retransmitted over a reliable link, the frames go
+        // back to the pool as soon as the output is done with them
+        if ((atomic_load_explicit(&bcp->link_caps, memory_order_relaxed) & BCP_TRANSPORT_RELIABLE) && retx_ring_full(bcp)) {
+            if (out_batch) {
+                output_batch_flush(bcp, out_batch);
+            }
+            retx_ring_drop(bcp, bcp->retx_count);
+        }
+    }
+
+    if (out_batch) {
+        output_batch_flush(bcp, out_batch);
+    }
+    if (atomic_load_explicit(&bcp->link_caps, memory_order_relaxed) & BCP_TRANSPORT_RELIABLE) {
+        retx_ring_drop(bcp, bcp->retx_count);
+    }
+}
+
+//---------------------------------------------------------------------
+// small message aggregation
+//---------------------------------------------------------------------
+// Sends the open aggregate in the frame kept for it, a lone message goes
+// as a plain frame without its length byte.
+static void agg_flush(bcp_t *bcp)
+{
+    if (bcp->agg_len == 0) {
+        return;
+    }
+
+    frame_t *frame = bcp->agg_frame;
+    uint8_t *payload = bcp->agg_buf;
+    uint32_t payload_len = bcp->agg_len;
+    uint32_t frame_type = BCP_FRAME_DATA_AGGREGATE;
+    if (bcp->agg_count == 1) {
+        payload++;
+        payload_len--;
+        frame_type = BCP_FRAME_DATA_COMPLETE;
+    }
+    bcp->agg_frame = NULL;
+    bcp->agg_len = 0;
+    bcp->agg_count = 0;
+
+    uint8_t wide = atomic_load_explicit(&bcp->wide_len, memory_order_relaxed);
+    if (bcp->aead != NULL) {
+        uint32_t seq = 0;
+        if (aead_seq_take(bcp->aead, 1, &seq) != 0) {
+            k_log(BCP_LOG_ERROR, "agg_flush, frame counters used up, recreate the bcp\n");
+            mem_free_to_pool(bcp, frame);
+            return;
+        }
+        data_frame_encrypt(bcp->aead, frame, payload, payload_len, frame_type, seq, wide);
+    } else {
+        data_frame_pack(frame, payload, payload_len, frame_type,
+                        data_crc_len(bcp, data_head_len(bcp) + payload_len), wide);
+    }
+
+    queue_init(&frame->node);
+    queue_add_tail(&frame->node, &bcp->retx_wait);
+    retx_wait_flush(bcp);
+}
+
+// Appends a message posted by agg_message_post. The first one opens the
+// window, the frame it came in is kept to send the aggregate.
+static void agg_message_handle(bcp_t *bcp, const void *context)
+{
+    frame_t *frame = (frame_t *)context;
+    if (bcp->agg_len + 1 + frame->frame_len > bcp->agg_cap) {
+        agg_flush(bcp);
+    }
+
+    if (bcp->agg_len == 0) {
+        bcp->agg_deadline_ms = bcp_adapter.bcp_time.get_ms() + bcp->agg_ms;
+        agg_timer_start(bcp);
+    }
+
+    bcp->agg_buf[bcp->agg_len++] = (uint8_t)frame->frame_len;
+    memcpy(bcp->agg_buf + bcp->agg_len, frame->frame_data, frame->frame_len);
+    bcp->agg_len += frame->frame_len;
+    bcp->agg_count++;
+
+    if (bcp->agg_frame == NULL) {
+        bcp->agg_frame = frame;
+    } else {
+        mem_free_to_pool(bcp, frame);
+    }
+
+    // not even an empty message fits any more
+    if (bcp->agg_len + 1 >= bcp->agg_cap) {
+        agg_flush(bcp);
+    }
+}
+
+static void bcp_fast_send_handle(bcp_t *bcp, const void *context)
+{
+    frame_t *frame = (frame_t *)context;
+
+    // messages keep their order
+    agg_flush(bcp);
+
+    queue_init(&frame->node);
+    queue_add_tail(&frame->node, &bcp->retx_wait);
+    retx_wait_flush(bcp);
+}
+
 static void bcp_send_handle(bcp_t *bcp, const void *context) 
 {
     queue_node_t *snd_list = (queue_node_t *)context;
 
+    // messages keep their order
+    agg_flush(bcp);
+
     frame_t *frame = NULL, *next_frame = NULL;
     LIST_FOR_EACH_ENTRY_SAFE(frame, next_frame, snd_list, frame_t, node) {
         queue_del(&frame->node);
-        data_frame_repack(bcp, frame);
-        data_frame_output(bcp, frame);
-
-        queue_add_tail(&frame->node, &bcp->ack_list);
+        queue_add_tail(&frame->node, &bcp->retx_wait);
     }
-
     mem_free_to_pool(bcp, snd_list);
+
+    retx_wait_flush(bcp);
 }
 
 static void bcp_ack_nack_send(bcp_t *bcp, uint8_t frame_type, uint8_t ack_fsn)
@@ -523,49 +2564,225 @@ static void bcp_ack_nack_send(bcp_t *bcp, uint8_t frame_type, uint8_t ack_fsn)
     memcpy(ack_frame, &frame_head, sizeof(frame_head));
     ack_frame[6] = ack_fsn;
 
-    uint16_t crc = bcp_adapter.bcp_crc.crc16_cal(ack_frame, 7);
+    uint16_t crc = bcp_crc16(ack_frame, 7);
     ack_frame[7] = crc;
     ack_frame[8] = crc >> 8;
 
-    bcp_block_t *bcp_block = (bcp_block_t *)bcp->owner;
-    if (bcp->output(bcp_block, ack_frame, 9) != 0) {
+    if (bcp_output(bcp, ack_frame, 9) != 0) {
         k_log(BCP_LOG_ERROR, "bcp_ack_nack_send, output fail, ack_fsn : %d, fsn : %d\n", ack_fsn, frame_head.fsn);
     }
 
     k_log(BCP_LOG_DEBUG, "bcp_ack_nack_send, ack_fsn is %d, frame_type is %d\n", ack_fsn, frame_type);
 }
 
+// Drops the dictionary of the received messages until the peer restarts
+// it, the next packed messages refer to a message never seen. The frames
+// were acked already, so the peer is asked for the restart. The request
+// goes again with every packed message dropped in the meantime, in case
+// it is lost.
+static void lz_rx_lost(bcp_t *bcp)
+{
+    if (bcp->lz != NULL && atomic_load_explicit(&bcp->lz->on, memory_order_relaxed)) {
+        bcp->lz->rx_lost = 1;
+        bcp_ack_nack_send(bcp, BCP_FRAME_LZ_RESET, 0);
+    }
+}
+
+// Hands a message to the application, through the compression stage when
+// it was agreed.
+static void app_message_deliver(bcp_t *bcp, uint8_t *data, uint32_t len)
+{
+    lz_session_t *lz = bcp->lz;
+    if (lz != NULL && atomic_load_explicit(&lz->on, memory_order_relaxed)) {
+        if (len < BCP_LZ_HEAD_LEN) {
+            k_log(BCP_LOG_ERROR, "app_message_deliver, message without compression head\n");
+            return;
+        }
+
+        uint8_t head = data[0];
+        data += BCP_LZ_HEAD_LEN;
+        len -= BCP_LZ_HEAD_LEN;
+        if (head & BCP_LZ_MSG_RESET) {
+            bcp_lz_dict_reset(&lz->rx);
+            lz->rx_lost = 0;
+        }
+
+        if (!(head & BCP_LZ_MSG_PACKED)) {
+            bcp_lz_dict_append(&lz->rx, data, len);
+        } else if (lz->rx_lost) {
+            k_log(BCP_LOG_WARN, "app_message_deliver, dictionary lost, message dropped\n");
+            lz_rx_lost(bcp);
+            return;
+        } else {
+            int32_t ret = bcp_lz_decompress(&lz->rx, lz->rx_buf, bcp->mal, data, len);
+            if (ret < 0) {
+                k_log(BCP_LOG_ERROR, "app_message_deliver, decompress fail, len : %d\n", len);
+                lz_rx_lost(bcp);
+                return;
+            }
+            data = lz->rx_buf;
+            len = (uint32_t)ret;
+        }
+    }
+
+    if (bcp->data_listener) {
+        bcp->data_listener((bcp_block_t *)bcp->owner, data, len);
+    }
+}
+
+// Splits an aggregate frame back into its messages, a bad length drops the
+// rest of the frame.
+static void app_aggregate_deliver(bcp_t *bcp, uint8_t *data, uint32_t len)
+{
+    uint32_t offset = 0;
+    while (offset < len) {
+        uint8_t msg_len = data[offset++];
+        if (msg_len > len - offset) {
+            k_log(BCP_LOG_ERROR, "app_aggregate_deliver, bad message len : %d\n", msg_len);
+            lz_rx_lost(bcp);
+            return;
+        }
+        app_message_deliver(bcp, data + offset, msg_len);
+        offset += msg_len;
+    }
+}
+
 static void app_data_notify(bcp_t *bcp, uint8_t *data, uint32_t len)
 {
-    bcp_ack_nack_send(bcp, BCP_FRAME_DATA_ACK, bcp->rcv_next);
+    if (!(atomic_load_explicit(&bcp->link_caps, memory_order_relaxed) & BCP_TRANSPORT_RELIABLE)) {
+        bcp_ack_nack_send(bcp, BCP_FRAME_DATA_ACK, bcp->rcv_next);
+    }
     bcp->rcv_next++;
 
-    if (bcp->mal_buf == NULL) {
-        k_log(BCP_LOG_ERROR, "app_data_notify, mal_buf is empty\n");
+    uint8_t head_len = data_head_len(bcp);
+    uint32_t frame_payload_len = len - head_len - bcp->recv_trailer_len;
+    uint8_t frame_type = data[2];
+
+    if (bcp->recv_msg_lost) {
+        if (frame_type != BCP_FRAME_DATA_COMPLETE && frame_type != BCP_FRAME_DATA_START &&
+            frame_type != BCP_FRAME_DATA_AGGREGATE) {
+            return;
+        }
+        bcp->recv_msg_lost = 0;
+        lz_rx_lost(bcp);
+    }
+
+    if (frame_type == BCP_FRAME_DATA_AGGREGATE) {
+        app_aggregate_deliver(bcp, &data[head_len], frame_payload_len);
+        return;
+    }
+
+    // a message of one frame is handed over straight from the frame buffer
+    if (frame_type == BCP_FRAME_DATA_COMPLETE && bcp->recv_app_data_offset == 0) {
+        app_message_deliver(bcp, &data[head_len], frame_payload_len);
         return;
     }
 
-    uint16_t frame_payload_len = len - 8;
-    if ((bcp->recv_app_data_offset + frame_payload_len) > bcp->mal) {
+    // room for the compression head too once it may have been agreed
+    uint32_t msg_max = bcp->mal + (bcp->lz != NULL ? BCP_LZ_HEAD_LEN : 0);
+    if ((bcp->recv_app_data_offset + frame_payload_len) > msg_max) {
         k_log(BCP_LOG_ERROR, "app_data_notify, app data len is too long, len : %d\n", bcp->recv_app_data_offset + frame_payload_len);
+        lz_rx_lost(bcp);
+        return;
+    }
+
+    if (rx_buf_reserve(bcp, &bcp->mal_buf, &bcp->mal_buf_size, bcp->recv_app_data_offset + frame_payload_len,
+                       bcp->recv_app_data_offset, msg_max) != 0) {
+        // The frame is acked already and nothing resends it, the message is
+        // dropped and its remaining frames are skipped.
+        k_log(BCP_LOG_ERROR, "app_data_notify, mal buf get mem fail, len : %d\n", bcp->recv_app_data_offset + frame_payload_len);
+        bcp->recv_app_data_offset = 0;
+        bcp->recv_msg_lost = 1;
+        lz_rx_lost(bcp);
         return;
     }
 
-    memcpy(bcp->mal_buf + bcp->recv_app_data_offset, &data[6], frame_payload_len);
+    memcpy(bcp->mal_buf + bcp->recv_app_data_offset, &data[head_len], frame_payload_len);
     bcp->recv_app_data_offset += frame_payload_len;
-    uint8_t frame_type = data[2];
     k_log(BCP_LOG_DEBUG, "app_data_notify, frame_type : %d, frame_payload_len : %d\n", frame_type, frame_payload_len);
     if (frame_type == BCP_FRAME_DATA_COMPLETE || 
         frame_type == BCP_FRAME_DATA_END ) {
         
-        bcp_block_t *bcp_block = (bcp_block_t *)bcp->owner;
-        if (bcp->data_listener) {
-            bcp->data_listener(bcp_block, bcp->mal_buf, bcp->recv_app_data_offset);
-        }
+        app_message_deliver(bcp, bcp->mal_buf, bcp->recv_app_data_offset);
         bcp->recv_app_data_offset = 0;
     } 
 }
 
+// Counters are taken by the sending threads and may reach the worker out
+// of order between messages, so a window of recent counters is kept. The
+// frames of one message carry consecutive counters.
+static int32_t aead_frame_accept(bcp_t *bcp)
+{
+    aead_session_t *aead = bcp->aead;
+    uint8_t frame_type = bcp->mfs_buf[2];
+    uint32_t seq = load32_le(bcp->mfs_buf + data_head_len(bcp) - BCP_AEAD_SEQ_LEN);
+
+    if (aead->rx_seen && seq <= aead->rx_top &&
+        (aead->rx_top - seq >= BCP_AEAD_WINDOW || (aead->rx_window >> (aead->rx_top - seq)) & 1)) {
+        k_log(BCP_LOG_WARN, "aead_frame_accept, replayed counter : %u\n", seq);
+        return -1;
+    }
+    if ((frame_type == BCP_FRAME_DATA_MIDDLE || frame_type == BCP_FRAME_DATA_END) &&
+        (!aead->rx_seen || seq != aead->rx_last + 1)) {
+        k_log(BCP_LOG_WARN, "aead_frame_accept, counter out of message order : %u\n", seq);
+        return -1;
+    }
+    if (bcp_aead_verify(&aead->rx, bcp->mfs_buf + bcp->recv_frame_len - BCP_AEAD_TAG_LEN) != 0) {
+        k_log(BCP_LOG_WARN, "aead_frame_accept, tag mismatch, counter : %u\n", seq);
+        return -1;
+    }
+
+    if (!aead->rx_seen) {
+        aead->rx_top = seq;
+        aead->rx_window = 1;
+    } else if (seq > aead->rx_top) {
+        uint32_t shift = seq - aead->rx_top;
+        aead->rx_window = shift >= BCP_AEAD_WINDOW ? 1 : aead->rx_window << shift | 1;
+        aead->rx_top = seq;
+    } else {
+        aead->rx_window |= (uint64_t)1 << (aead->rx_top - seq);
+    }
+    aead->rx_last = seq;
+    aead->rx_seen = 1;
+    return 0;
+}
+
+// Copies a slice of an encrypted frame, the cipher text is authenticated
+// and deciphered on the way. The message starts once the counter is in.
+static void aead_slice_copy(bcp_t *bcp, uint8_t *dst, const uint8_t *src, uint16_t len)
+{
+    aead_session_t *aead = bcp->aead;
+    uint32_t offset = bcp->recv_frame_offset;
+    uint8_t head_len = data_head_len(bcp);
+    uint8_t aad_len = head_len - BCP_AEAD_SEQ_LEN;
+    uint32_t body_end = bcp->recv_frame_len - BCP_AEAD_TAG_LEN;
+
+    while (len > 0) {
+        uint16_t n = len;
+        if (offset < head_len) {
+            n = head_len - offset < len ? head_len - offset : len;
+            memcpy(dst, src, n);
+            if (offset + n == head_len) {
+                uint8_t nonce[BCP_AEAD_NONCE_LEN];
+                memcpy(nonce, aead->rx_salt, BCP_AEAD_SALT_LEN);
+                memcpy(nonce + BCP_AEAD_SALT_LEN, bcp->mfs_buf + aad_len, BCP_AEAD_SEQ_LEN);
+                uint8_t aad[sizeof(bcp_frame_head_t) + BCP_WIDE_LEN_LEN + BCP_AEAD_SALT_LEN];
+                uint8_t bound_len = aead_frame_aad(aad, bcp->mfs_buf, aad_len, aead->rx_bind);
+                bcp_aead_start(&aead->rx, aead->key, nonce, aad, bound_len);
+            }
+        } else if (offset < body_end) {
+            n = body_end - offset < len ? body_end - offset : len;
+            bcp_aead_decrypt(&aead->rx, dst, src, n);
+        } else {
+            memcpy(dst, src, n);
+        }
+        dst += n;
+        src += n;
+        len -= n;
+        offset += n;
+    }
+}
+
 static void frame_completeness_check(bcp_t *bcp)
 {
     k_log(BCP_LOG_DEBUG, "frame_completeness_check, recv_frame_offset : %d, recv_frame_len : %d\n", bcp->recv_frame_offset, bcp->recv_frame_len);
@@ -573,26 +2790,67 @@ static void frame_completeness_check(bcp_t *bcp)
         bcp->recv_frame_flag = 0;
         bcp->recv_frame_offset = 0;
 
-        uint16_t cur_crc = bcp->mfs_buf[bcp->recv_frame_len - 1];
-        cur_crc = cur_crc << 8 | bcp->mfs_buf[bcp->recv_frame_len - 2];
-        uint16_t cal_crc = bcp_adapter.bcp_crc.crc16_cal(bcp->mfs_buf, bcp->recv_frame_len - 2);
+        uint8_t frame_ok = 0;
+        if (bcp->aead != NULL) {
+            frame_ok = aead_frame_accept(bcp) == 0;
+        } else if (bcp->recv_trailer_len == 0) {
+            frame_ok = 1;
+        } else {
+            uint8_t crc_len = bcp->recv_trailer_len;
+            uint32_t cur_crc = crc_trailer_get(bcp->mfs_buf + bcp->recv_frame_len - crc_len, crc_len);
+            uint32_t cal_crc = bcp->recv_frame_crc;
+            if (crc_len == 2 && bcp_adapter.bcp_crc.crc16_cal != NULL) {
+                cal_crc = bcp_crc16(bcp->mfs_buf, bcp->recv_frame_len - 2);
+            }
+            k_log(BCP_LOG_DEBUG, "frame_completeness_check, cur_crc : %08x, cal_crc : %08x\n", cur_crc, cal_crc);
+            frame_ok = cal_crc == cur_crc;
+        }
+
+        if (frame_ok) {
+            app_data_notify(bcp, bcp->mfs_buf, bcp->recv_frame_len);
+        } else {
+            bcp_ack_nack_send(bcp, BCP_FRAME_DATA_NACK, bcp->rcv_next);
+        }
+        bcp->recv_frame_len = 0;
+    }
+}
+
+static void slice_process(bcp_t *bcp, mtu_t *mtu_buf)
+{
+    k_log(BCP_LOG_DEBUG, "slice_process, data_len : %d\n", mtu_buf->data_len);
+
+    if (bcp->recv_frame_offset + mtu_buf->data_len > bcp->recv_frame_len) {
+        // A slice of this frame has been lost and the data belongs to a later one.
+        k_log(BCP_LOG_WARN, "slice_process, frame overrun, recv_frame_len : %d\n", bcp->recv_frame_len);
+        mem_free_to_pool(bcp, mtu_buf);
+        bcp->recv_frame_flag = 0;
+        bcp->recv_frame_offset = 0;
+        bcp->recv_frame_len = 0;
+        bcp_ack_nack_send(bcp, BCP_FRAME_DATA_NACK, bcp->rcv_next);
+        return;
+    }
 
-        k_log(BCP_LOG_DEBUG, "frame_completeness_check, cur_crc : %04x, cal_crc : %04x\n", cur_crc, cal_crc);
-        if (cal_crc == cur_crc) {
-            app_data_notify(bcp, bcp->mfs_buf, bcp->recv_frame_len);
+    uint8_t *p = bcp->mfs_buf + bcp->recv_frame_offset;
+    uint8_t trailer_len = bcp->recv_trailer_len;
+    if (bcp->aead != NULL) {
+        aead_slice_copy(bcp, p, mtu_buf->data, mtu_buf->data_len);
+    } else if (trailer_len == 4 || (trailer_len == 2 && bcp_adapter.bcp_crc.crc16_cal == NULL)) {
+        // checksum the slice while it is copied, the crc trailer is left out
+        uint32_t body_len = bcp->recv_frame_len - trailer_len;
+        uint32_t crc_len = 0;
+        if (bcp->recv_frame_offset < body_len) {
+            crc_len = body_len - bcp->recv_frame_offset;
+            crc_len = crc_len > mtu_buf->data_len ? mtu_buf->data_len : crc_len;
+        }
+        if (trailer_len == 4) {
+            bcp->recv_frame_crc = bcp_crc32c_copy(bcp->recv_frame_crc, p, mtu_buf->data, crc_len);
         } else {
-            bcp_ack_nack_send(bcp, BCP_FRAME_DATA_NACK, bcp->rcv_next);
+            bcp->recv_frame_crc = bcp_crc16_copy((uint16_t)bcp->recv_frame_crc, p, mtu_buf->data, crc_len);
         }
-        bcp->recv_frame_len = 0;
+        memcpy(p + crc_len, mtu_buf->data + crc_len, mtu_buf->data_len - crc_len);
+    } else {
+        memcpy(p, mtu_buf->data, mtu_buf->data_len);
     }
-}
-
-static void slice_process(bcp_t *bcp, mtu_t *mtu_buf)
-{
-    k_log(BCP_LOG_DEBUG, "slice_process, data_len : %d\n", mtu_buf->data_len);
-
-    uint8_t *p = bcp->mfs_buf;
-    memcpy(p + bcp->recv_frame_offset, mtu_buf->data, mtu_buf->data_len);
     bcp->recv_frame_offset += mtu_buf->data_len;
     mem_free_to_pool(bcp, mtu_buf);
 
@@ -603,12 +2861,35 @@ static void first_slice_process(bcp_t *bcp, mtu_t *mtu_buf)
 {
     uint8_t fsn = mtu_buf->data[3];
     k_log(BCP_LOG_DEBUG, "first_slice_process, fsn : %d, bcp->rcv_next : %d, data_len : %d\n", bcp->rcv_next, fsn, mtu_buf->data_len);
-    if (fsn == bcp->rcv_next) {
+    uint32_t payload_len = mtu_buf->data[5];
+    payload_len = payload_len << 8 | mtu_buf->data[4];
+    if (atomic_load_explicit(&bcp->wide_len, memory_order_relaxed)) {
+        payload_len |= (uint32_t)mtu_buf->data[6] << 16 | (uint32_t)mtu_buf->data[7] << 24;
+    }
+    uint32_t body_len = payload_len + data_head_len(bcp);
+    uint8_t trailer_len = recv_trailer_len(bcp, body_len, mtu_buf->data_len);
+    uint32_t frame_len = body_len + trailer_len;
+
+    if (fsn != bcp->rcv_next && (atomic_load_explicit(&bcp->link_caps, memory_order_relaxed) & BCP_TRANSPORT_RELIABLE)) {
+        // nothing is retransmitted, the frames bcp_input refused are gone
+        k_log(BCP_LOG_ERROR, "first_slice_process, frames lost, fsn : %d, rcv_next : %d\n", fsn, bcp->rcv_next);
+        bcp->rcv_next = fsn;
+        bcp->recv_app_data_offset = 0;
+        bcp->recv_msg_lost = 1;
+    }
+
+    if (fsn == bcp->rcv_next && frame_len <= bcp->peer_mfs &&
+        rx_buf_reserve(bcp, &bcp->mfs_buf, &bcp->mfs_buf_size, frame_len, 0, bcp->peer_mfs) == 0) {
         bcp->recv_frame_flag = 1;
-        uint16_t payload_len = mtu_buf->data[5];
-        payload_len = payload_len << 8 | mtu_buf->data[4];
-        bcp->recv_frame_len = payload_len + 8;
+        bcp->recv_frame_len = frame_len;
+        bcp->recv_trailer_len = trailer_len;
+        bcp->recv_frame_crc = 0;
         slice_process(bcp, mtu_buf);
+    } else if (fsn_diff(fsn, bcp->rcv_next) < 0) {
+        // resent before our ack got through, a NACK would only have the
+        // sender go back over its whole ring once more
+        mem_free_to_pool(bcp, mtu_buf);
+        bcp_ack_nack_send(bcp, BCP_FRAME_DATA_ACK, bcp->rcv_next - 1);
     } else {
         mem_free_to_pool(bcp, mtu_buf);
         bcp_ack_nack_send(bcp, BCP_FRAME_DATA_NACK, bcp->rcv_next);
@@ -620,21 +2901,23 @@ static void bcp_input_data_process(bcp_t *bcp, const void *context)
     mtu_t *mtu_buf = (mtu_t *)context;
     k_log(BCP_LOG_DEBUG, "bcp_input_data_process, recv_frame_flag : %d, data_len : %d\n", bcp->recv_frame_flag, mtu_buf->data_len);
 
-    if (bcp->mfs_buf == NULL) {
+    if (bcp->peer_mfs == 0) {
         mem_free_to_pool(bcp, mtu_buf);
-        k_log(BCP_LOG_ERROR, "bcp_input_data_process, mfs_buf is empty\n");
+        k_log(BCP_LOG_ERROR, "bcp_input_data_process, no sync yet\n");
         return;
     }
 
     if (bcp->recv_frame_flag == 1) {
         slice_process(bcp, mtu_buf);
     } else {
-        if (mtu_buf->data_len >= 8) {
+        uint8_t wide = atomic_load_explicit(&bcp->wide_len, memory_order_relaxed);
+        if (mtu_buf->data_len > sizeof(bcp_frame_head_t) + (wide ? BCP_WIDE_LEN_LEN : 0)) {
             uint8_t frame_type = mtu_buf->data[2];
             if (frame_type == BCP_FRAME_DATA_COMPLETE ||
                 frame_type == BCP_FRAME_DATA_START ||
                 frame_type == BCP_FRAME_DATA_MIDDLE ||
-                frame_type == BCP_FRAME_DATA_END) {
+                frame_type == BCP_FRAME_DATA_END ||
+                frame_type == BCP_FRAME_DATA_AGGREGATE) {
                     first_slice_process(bcp, mtu_buf);
             } else {
                 mem_free_to_pool(bcp, mtu_buf);
@@ -653,25 +2936,40 @@ static void bcp_input_ack_process(bcp_t *bcp, const void *context)
     mtu_t *mtu_buf = (mtu_t *)context;
     uint16_t cur_crc = mtu_buf->data[8];
     cur_crc = cur_crc << 8 | mtu_buf->data[7];
-    uint16_t cal_crc = bcp_adapter.bcp_crc.crc16_cal(mtu_buf->data, 7);
+    uint16_t cal_crc = bcp_crc16(mtu_buf->data, 7);
     if (cal_crc != cur_crc) {
         k_log(BCP_LOG_ERROR, "bcp_input_ack_process, crc error, cal_crc : %d, cur_crc : %d\n", cal_crc, cur_crc);
+        mem_free_to_pool(bcp, mtu_buf);
         return;
     } 
 
     uint8_t ack_fsn = mtu_buf->data[6];
     mem_free_to_pool(bcp, mtu_buf);
 
-    frame_t *frame = NULL, *next_frame = NULL;
-    LIST_FOR_EACH_ENTRY_SAFE(frame, next_frame, &bcp->ack_list, frame_t, node) {
+    // cumulative, every frame up to ack_fsn is done
+    retx_ring_drop(bcp, retx_ring_before(bcp, ack_fsn + 1));
+    if (!queue_is_empty(&bcp->retx_wait)) {
+        retx_wait_flush(bcp);
+    }
+}
 
-        if (fsn_diff(ack_fsn, frame->fsn) >= 0) {
-            queue_del(&frame->node);
-            mem_free_to_pool(bcp, frame);
-        } 
-        else {
-            break;
-        }
+// The peer dropped a message it could not decompress, the next message
+// sent restarts both dictionaries.
+static void bcp_input_lz_reset_process(bcp_t *bcp, const void *context)
+{
+    mtu_t *mtu_buf = (mtu_t *)context;
+    uint16_t cur_crc = mtu_buf->data[8];
+    cur_crc = cur_crc << 8 | mtu_buf->data[7];
+    uint16_t cal_crc = bcp_crc16(mtu_buf->data, 7);
+    mem_free_to_pool(bcp, mtu_buf);
+    if (cal_crc != cur_crc) {
+        k_log(BCP_LOG_ERROR, "bcp_input_lz_reset_process, crc error, cal_crc : %d, cur_crc : %d\n", cal_crc, cur_crc);
+        return;
+    }
+
+    if (bcp->lz != NULL) {
+        k_log(BCP_LOG_WARN, "bcp_input_lz_reset_process, peer lost the dictionary\n");
+        atomic_store_explicit(&bcp->lz->tx_reset, 1, memory_order_relaxed);
     }
 }
 
@@ -680,127 +2978,202 @@ static void bcp_input_nack_process(bcp_t *bcp, const void *context)
     mtu_t *mtu_buf = (mtu_t *)context;
     uint16_t cur_crc = mtu_buf->data[8];
     cur_crc = cur_crc << 8 | mtu_buf->data[7];
-    uint16_t cal_crc = bcp_adapter.bcp_crc.crc16_cal(mtu_buf->data, 7);
+    uint16_t cal_crc = bcp_crc16(mtu_buf->data, 7);
     if (cal_crc != cur_crc) {
         k_log(BCP_LOG_ERROR, "bcp_input_nack_process, crc error, cal_crc : %d, cur_crc : %d\n", cal_crc, cur_crc);
+        mem_free_to_pool(bcp, mtu_buf);
         return;
     } 
 
     uint8_t nack_fsn = mtu_buf->data[6];
     mem_free_to_pool(bcp, mtu_buf);
 
-    frame_t *frame = NULL, *next_frame = NULL;
-    LIST_FOR_EACH_ENTRY_SAFE(frame, next_frame, &bcp->ack_list, frame_t, node) {
+    output_batch_t batch;
+    batch.count = 0;
+    output_batch_t *out_batch = bcp->output_batch ? &batch : NULL;
 
-        if (fsn_diff(nack_fsn, frame->fsn) <= 0) {
-            data_frame_output(bcp, frame);
-        } else {
-            queue_del(&frame->node);
-            mem_free_to_pool(bcp, frame);
-        }
+    // the frames before nack_fsn arrived, the rest is sent again
+    retx_ring_drop(bcp, retx_ring_before(bcp, nack_fsn));
+    for (uint16_t i = 0; i < bcp->retx_count; i++) {
+        const frame_t *frame = bcp->retx_ring[(uint8_t)(bcp->retx_head + i) & bcp->retx_mask];
+        data_frame_output(bcp, frame, out_batch);
+    }
+
+    if (out_batch) {
+        output_batch_flush(bcp, out_batch);
+    }
+}
+
+// Switches to the frame stages both ends agreed on.
+static void sync_flags_apply(bcp_t *bcp, uint8_t flags)
+{
+    uint8_t crc_len = (flags & BCP_SYNC_FLAG_CRC32C) ? 4 : 2;
+    atomic_store_explicit(&bcp->crc_len, crc_len, memory_order_relaxed);
+
+    // a byte stream has no packets to keep intact on their own, the
+    // deframer cannot tell a frame sent in one packet
+    uint8_t caps = (flags & BCP_SYNC_FLAG_RELIABLE) ? BCP_TRANSPORT_RELIABLE : 0;
+    if ((flags & BCP_SYNC_FLAG_INTEGRITY) && (caps || bcp->stream_buf == NULL)) {
+        caps |= BCP_TRANSPORT_INTEGRITY;
+    }
+    atomic_store_explicit(&bcp->link_caps, caps, memory_order_relaxed);
+
+    // the peer may have restarted, its dictionary with it
+    if (bcp->lz != NULL) {
+        atomic_store_explicit(&bcp->lz->on, (flags & BCP_SYNC_FLAG_LZ) ? 1 : 0, memory_order_relaxed);
+        atomic_store_explicit(&bcp->lz->tx_reset, 1, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&bcp->wide_len, (flags & BCP_SYNC_FLAG_WIDE) ? 1 : 0, memory_order_relaxed);
+
+    // room is left for the length byte of the message
+    uint16_t agg_max = 0;
+    if ((flags & BCP_SYNC_FLAG_AGGREGATE) && bcp->agg_cap > 1) {
+        agg_max = bcp->agg_cap - 1 < BCP_AGG_MSG_MAX ? bcp->agg_cap - 1 : BCP_AGG_MSG_MAX;
     }
+    atomic_store_explicit(&bcp->agg_max, agg_max, memory_order_relaxed);
+
+    k_log(BCP_LOG_INFO, "bcp sync, flags : %02x\n", flags);
 }
 
-static void bcp_sync_rsp_send(bcp_t *bcp, uint8_t fsn) 
+// The flags are echoed only to a peer that sent some, older peers expect
+// an empty SYNC_ACK.
+// The bind of an encrypted link follows the flags.
+static void bcp_sync_rsp_send(bcp_t *bcp, uint8_t fsn, bool with_flags, uint8_t flags) 
 {
-    uint8_t sync_rsp_frame[8];
+    uint8_t sync_rsp_frame[9 + BCP_AEAD_SALT_LEN];
 
     bcp_frame_head_t frame_head;
     frame_head.magic_head = BCP_MAGIC_HEAD;
     frame_head.ctrl = BCP_FRAME_SYNC_ACK;
     frame_head.fsn = fsn;  
-    frame_head.len = 0;
+    frame_head.len = with_flags ? 1 : 0;
+    if (with_flags && (flags & BCP_SYNC_FLAG_AEAD)) {
+        memcpy(&sync_rsp_frame[7], bcp->aead->rx_bind, BCP_AEAD_SALT_LEN);
+        frame_head.len += BCP_AEAD_SALT_LEN;
+    }
     
     memcpy(sync_rsp_frame, &frame_head, sizeof(frame_head));
+    sync_rsp_frame[6] = flags;
 
-    uint16_t crc = bcp_adapter.bcp_crc.crc16_cal(sync_rsp_frame, 6);
-    sync_rsp_frame[6] = crc;
-    sync_rsp_frame[7] = crc >> 8;
+    uint16_t crc = bcp_crc16(sync_rsp_frame, 6 + frame_head.len);
+    sync_rsp_frame[6 + frame_head.len] = crc;
+    sync_rsp_frame[7 + frame_head.len] = crc >> 8;
 
-    bcp_block_t *bcp_block = (bcp_block_t *)bcp->owner;
-    if (bcp->output(bcp_block, sync_rsp_frame, 8) != 0) {
+    if (bcp_output(bcp, sync_rsp_frame, 8 + frame_head.len) != 0) {
         k_log(BCP_LOG_ERROR, "bcp_sync_rsp_send, output fail, fsn : %d\n", fsn);
     }
 }
 static void bcp_input_sync_req_process(bcp_t *bcp, const void *context) 
 {
     mtu_t *mtu_buf = (mtu_t *)context;
-    uint16_t cur_crc = mtu_buf->data[9];
-    cur_crc = cur_crc << 8 | mtu_buf->data[8];
-    uint16_t cal_crc = bcp_adapter.bcp_crc.crc16_cal(mtu_buf->data, 8);
+    uint16_t len = mtu_buf->data[4] | mtu_buf->data[5] << 8;
+    if (len < 2 || len > 3 + BCP_AEAD_SALT_LEN + BCP_WIDE_LEN_LEN || mtu_buf->data_len < 8 + len) {
+        k_log(BCP_LOG_ERROR, "bcp_input_sync_req_process, bad len : %d\n", len);
+        mem_free_to_pool(bcp, mtu_buf);
+        return;
+    }
+
+    uint16_t cur_crc = mtu_buf->data[7 + len];
+    cur_crc = cur_crc << 8 | mtu_buf->data[6 + len];
+    uint16_t cal_crc = bcp_crc16(mtu_buf->data, 6 + len);
     if (cal_crc != cur_crc) {
         k_log(BCP_LOG_ERROR, "bcp_input_sync_req_process, crc error, cal_crc : %04x, cur_crc : %04x\n", cal_crc, cur_crc);
+        mem_free_to_pool(bcp, mtu_buf);
         return;
     } 
 
     uint8_t first_fsn = mtu_buf->data[3];
-    uint16_t peer_mfs = mtu_buf->data[7];
+    uint32_t peer_mfs = mtu_buf->data[7];
     peer_mfs = peer_mfs << 8 | mtu_buf->data[6];
-    mem_free_to_pool(bcp, mtu_buf);
-    
-    // first clean
-    if (bcp->mal_buf) {
-        bcp_adapter.bcp_mem.bcp_free(bcp->mal_buf);
-        bcp->mal_buf = NULL;
+    uint8_t flags = len > 2 ? mtu_buf->data[8] : 0;
+    if ((flags & BCP_SYNC_FLAG_AEAD) && len < 3 + BCP_AEAD_SALT_LEN) {
+        flags &= ~BCP_SYNC_FLAG_AEAD;
     }
-
-    if (bcp->mfs_buf) {
-        bcp_adapter.bcp_mem.bcp_free(bcp->mfs_buf);
-        bcp->mfs_buf = NULL;
+    uint16_t wide_at = 3 + ((flags & BCP_SYNC_FLAG_AEAD) ? BCP_AEAD_SALT_LEN : 0);
+    if ((flags & BCP_SYNC_FLAG_WIDE) && len < wide_at + BCP_WIDE_LEN_LEN) {
+        flags &= ~BCP_SYNC_FLAG_WIDE;
+    }
+    // the high half only counts once both ends read wide lengths, the low
+    // one is saturated for the others
+    if (flags & bcp->sync_offer & BCP_SYNC_FLAG_WIDE) {
+        peer_mfs |= (uint32_t)mtu_buf->data[6 + wide_at] << 16 | (uint32_t)mtu_buf->data[7 + wide_at] << 24;
+    }
+    if ((bcp->aead != NULL) != ((flags & BCP_SYNC_FLAG_AEAD) != 0)) {
+        // never fall back to plain frames, nor start them with a peer that has no key
+        k_log(BCP_LOG_ERROR, "bcp input sync req, encryption mismatch, flags : %d\n", flags);
+        mem_free_to_pool(bcp, mtu_buf);
+        return;
+    }
+    if (bcp->aead != NULL && memcmp(bcp->aead->rx_salt, &mtu_buf->data[9], BCP_AEAD_SALT_LEN) != 0) {
+        // a new peer instance, its counters start over. A new bind keeps the
+        // frames recorded under any earlier salt from coming back.
+        memcpy(bcp->aead->rx_salt, &mtu_buf->data[9], BCP_AEAD_SALT_LEN);
+        bcp->aead->rx_seen = 0;
+        bcp_adapter.bcp_random.random_fill(bcp->aead->rx_bind, BCP_AEAD_SALT_LEN);
     }
+    mem_free_to_pool(bcp, mtu_buf);
 
+    // a static arena reserves the receive buffers for the own mfs
+    if (bcp->static_mem && peer_mfs > bcp->mfs) {
+        k_log(BCP_LOG_ERROR, "bcp input sync req, peer mfs exceeds the arena, peer_mfs : %d\n", peer_mfs);
+        return;
+    }
+    
     bcp->recv_app_data_offset = 0;
     bcp->recv_frame_flag = 0;
     bcp->recv_frame_offset = 0;
     bcp->recv_frame_len = 0;
 
-    // resource init
+    // resource init, the receive buffers grow with the traffic and
+    // survive a new handshake
     bcp->rcv_next = first_fsn + 1;
+    bcp->peer_mfs = peer_mfs;
 
-    bcp->mfs_buf = (uint8_t *)bcp_adapter.bcp_mem.bcp_malloc(peer_mfs);
-    if (bcp->mfs_buf == NULL) {
-        k_log(BCP_LOG_ERROR, "bcp input sync req, mfs buf get mem fail, peer_mfs : %d\n", peer_mfs);
-        goto mfs_buf_init_fail;
-    }
-
-    bcp->mal_buf = (uint8_t *)bcp_adapter.bcp_mem.bcp_malloc(bcp->mal);
-    if (bcp->mal_buf == NULL) {
-        k_log(BCP_LOG_ERROR, "bcp input sync req, mal buf get mem fail, mal : %d\n", bcp->mal);
-        goto mal_buf_init_fail;
-    }
-
-    bcp_sync_rsp_send(bcp, first_fsn);
-
-    return;
-
-mal_buf_init_fail:
-    bcp_adapter.bcp_mem.bcp_free(bcp->mfs_buf);
-    bcp->mfs_buf = NULL;
-    
-mfs_buf_init_fail:
-    return;
+    flags &= bcp->sync_offer;
+    sync_flags_apply(bcp, flags);
 
+    bcp_sync_rsp_send(bcp, first_fsn, len > 2, flags);
 }
 
 static void bcp_input_sync_rsp_process(bcp_t *bcp, const void *context) 
 {
     mtu_t *mtu_buf = (mtu_t *)context;
-    uint16_t cur_crc = mtu_buf->data[7];
-    cur_crc = cur_crc << 8 | mtu_buf->data[6];
-    uint16_t cal_crc = bcp_adapter.bcp_crc.crc16_cal(mtu_buf->data, 6);
+    uint16_t len = mtu_buf->data[4] | mtu_buf->data[5] << 8;
+    if (len > 1 + BCP_AEAD_SALT_LEN || mtu_buf->data_len < 8 + len) {
+        k_log(BCP_LOG_ERROR, "bcp_input_sync_rsp_process, bad len : %d\n", len);
+        mem_free_to_pool(bcp, mtu_buf);
+        return;
+    }
+
+    uint16_t cur_crc = mtu_buf->data[7 + len];
+    cur_crc = cur_crc << 8 | mtu_buf->data[6 + len];
+    uint16_t cal_crc = bcp_crc16(mtu_buf->data, 6 + len);
     if (cal_crc != cur_crc) {
         k_log(BCP_LOG_ERROR, "bcp_input_sync_rsp_process, crc error, cal_crc : %04x, cur_crc : %04x\n", cal_crc, cur_crc);
+        mem_free_to_pool(bcp, mtu_buf);
         return;
     } 
+    uint8_t flags = len > 0 ? mtu_buf->data[6] : 0;
+    if (bcp->aead != NULL && (!(flags & BCP_SYNC_FLAG_AEAD) || len < 1 + BCP_AEAD_SALT_LEN)) {
+        k_log(BCP_LOG_ERROR, "bcp_input_sync_rsp_process, peer does not encrypt\n");
+        mem_free_to_pool(bcp, mtu_buf);
+        return;
+    }
+    if (bcp->aead != NULL) {
+        // frames still waiting are sealed again for the new bind
+        aead_session_t *aead = bcp->aead;
+        uint8_t gen = atomic_load_explicit(&aead->tx_gen, memory_order_relaxed) + 1;
+        memcpy(aead->tx_bind[gen & 1], &mtu_buf->data[7], BCP_AEAD_SALT_LEN);
+        atomic_store_explicit(&aead->tx_gen, gen, memory_order_release);
+    }
     mem_free_to_pool(bcp, mtu_buf);
 
-    bcp_adapter.bcp_timer.timer_stop(&bcp->timer);
+    sync_flags_apply(bcp, flags & bcp->sync_offer);
 
-    frame_t *frame = NULL, *next_frame = NULL;
-    LIST_FOR_EACH_ENTRY_SAFE(frame, next_frame, &bcp->ack_list, frame_t, node) {
-        queue_del(&frame->node);
-        mem_free_to_pool(bcp, frame);
-    }
+    sync_timer_stop(bcp);
+    retx_ring_drop(bcp, bcp->retx_count);
+    retx_wait_flush(bcp);
 
     bcp->status = BCP_DONE;
 
@@ -810,15 +3183,9 @@ static void bcp_input_sync_rsp_process(bcp_t *bcp, const void *context)
     }
 }
 
-int32_t bcp_input(bcp_block_t *bcp_block, void *data, uint32_t len)
+static int32_t bcp_input_post(bcp_t *bcp, void *data, uint32_t len)
 {
-    bcp_t *bcp = bcp_block->bcp;
-    if (len > bcp->mtu) {
-        k_log(BCP_LOG_ERROR, "bcp_input, input data len is too long, len : %d\n", len);
-        return -1;
-    }
-    
-    mtu_t *mtu_buf = (mtu_t *)mem_get_from_pool(bcp, &bcp->mtu_mem_pool);
+    mtu_t *mtu_buf = (mtu_t *)bcp_mem_get(bcp, &bcp->mtu_mem_pool, sizeof(mtu_t) + len);
     if (mtu_buf == NULL) {
         k_log(BCP_LOG_ERROR, "bcp_input, mtu buf mem get fail\n");
         return -2;
@@ -843,6 +3210,8 @@ int32_t bcp_input(bcp_block_t *bcp_block, void *data, uint32_t len)
                 ret = bcp_event_post_prior(bcp, mtu_buf, bcp_input_ack_process);
             } else if (frame_type == BCP_FRAME_DATA_NACK) {
                 ret = bcp_event_post_prior(bcp, mtu_buf, bcp_input_nack_process);
+            } else if (frame_type == BCP_FRAME_LZ_RESET) {
+                ret = bcp_event_post_prior(bcp, mtu_buf, bcp_input_lz_reset_process);
             } else if (frame_type == BCP_FRAME_SYNC_REQ) {
                 ret = bcp_event_post_prior(bcp, mtu_buf, bcp_input_sync_req_process);
             } else if (frame_type == BCP_FRAME_SYNC_ACK) {
@@ -866,20 +3235,370 @@ int32_t bcp_input(bcp_block_t *bcp_block, void *data, uint32_t len)
     return 0;
 }
 
-bcp_block_t *bcp_create(const bcp_parm_t *bcp_parm, const bcp_interface_t *bcp_interface, const void *user_data)
+int32_t bcp_input(bcp_block_t *bcp_block, void *data, uint32_t len)
 {
-    bcp_block_t *bcp_block = (bcp_block_t *)bcp_adapter.bcp_mem.bcp_malloc(sizeof(bcp_block_t));
-    if (bcp_block == NULL) {
-        k_log(BCP_LOG_ERROR, "bcp create, bcp_block get mem fail\n");
-        return NULL;  
+    bcp_t *bcp = bcp_block->bcp;
+    if (len > bcp->mtu) {
+        k_log(BCP_LOG_ERROR, "bcp_input, input data len is too long, len : %d\n", len);
+        return -1;
     }
 
-    bcp_block->bcp = (bcp_t *)bcp_adapter.bcp_mem.bcp_malloc(sizeof(bcp_t));
-    if (bcp_block->bcp == NULL) {
-        k_log(BCP_LOG_ERROR, "bcp create, bcp get mem fail\n");
-        goto bcp_mem_fail; 
+    if (bcp_session_enter(bcp) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp_input, resume fail\n");
+        return -2;
+    }
+
+    int32_t ret = bcp_input_post(bcp, data, len);
+    bcp_session_leave(bcp);
+
+    return ret;
+}
+
+//---------------------------------------------------------------------
+// byte stream deframer
+//---------------------------------------------------------------------
+static bool frame_type_is_valid(uint8_t frame_type)
+{
+    return (frame_type >= BCP_FRAME_DATA_COMPLETE && frame_type <= BCP_FRAME_LZ_RESET) ||
+            frame_type == BCP_FRAME_SYNC_REQ || frame_type == BCP_FRAME_SYNC_ACK;
+}
+
+// Returns the first candidate sync word, a trailing lone low byte counts as one.
+// memchr is word or vector based in the usual C libraries, so only candidate
+// positions are looked at byte by byte.
+static uint8_t *stream_magic_find(uint8_t *data, uint32_t len)
+{
+    uint8_t *end = data + len;
+    while (data < end) {
+        uint8_t *p = (uint8_t *)memchr(data, (uint8_t)BCP_MAGIC_HEAD, end - data);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        if (p + 1 == end || p[1] == (uint8_t)(BCP_MAGIC_HEAD >> 8)) {
+            return p;
+        }
+        data = p + 1;
+    }
+
+    return NULL;
+}
+
+// Hands a frame over in mtu slices, resuming after the slices already taken.
+static int32_t stream_frame_deliver(bcp_block_t *bcp_block, uint8_t *frame, uint32_t frame_len)
+{
+    bcp_t *bcp = bcp_block->bcp;
+    while (bcp->stream_sent < frame_len) {
+        uint32_t len = frame_len - bcp->stream_sent;
+        len = len > bcp->mtu ? bcp->mtu : len;
+        if (bcp_input(bcp_block, frame + bcp->stream_sent, len) != 0) {
+            k_log(BCP_LOG_WARN, "stream_frame_deliver, input busy, frame_len : %d\n", frame_len);
+            return -1;
+        }
+        bcp->stream_sent += len;
+    }
+
+    bcp->stream_sent = 0;
+    return 0;
+}
+
+// Consumes as many complete frames as possible from the stream buffer.
+// Returns -1 when the BCP block is busy, held_len is then the length of
+// the complete frame left at the stream head.
+static int32_t stream_frames_extract(bcp_block_t *bcp_block, uint32_t *held_len)
+{
+    bcp_t *bcp = bcp_block->bcp;
+
+    while (bcp->stream_len > 0) {
+        uint8_t *data = bcp->stream_buf + bcp->stream_head;
+        uint8_t *magic = stream_magic_find(data, bcp->stream_len);
+        if (magic == NULL) {
+            bcp->stream_head = 0;
+            bcp->stream_len = 0;
+            return 0;
+        }
+
+        uint32_t skip = magic - data;
+        bcp->stream_head += skip;
+        bcp->stream_len -= skip;
+        data = magic;
+        if (bcp->stream_len < sizeof(bcp_frame_head_t)) {
+            return 0;
+        }
+
+        uint8_t is_data = frame_type_is_data(data[2]);
+        uint8_t crc_len = 2;
+        if (is_data && bcp->aead != NULL) {
+            crc_len = BCP_AEAD_TAG_LEN;
+        } else if (is_data) {
+            // INTEGRITY is only agreed along with RELIABLE on a byte stream
+            crc_len = data_crc_len(bcp, 0);
+        }
+        uint32_t frame_len = data[5];
+        frame_len = frame_len << 8 | data[4];
+        if (is_data && atomic_load_explicit(&bcp->wide_len, memory_order_relaxed)) {
+            if (bcp->stream_len < sizeof(bcp_frame_head_t) + BCP_WIDE_LEN_LEN) {
+                return 0;
+            }
+            frame_len |= (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+        }
+        frame_len += (is_data ? data_head_len(bcp) : 6) + crc_len;
+        if (!frame_type_is_valid(data[2]) || frame_len > bcp->mfs) {
+            // Not a frame head, resync from the next byte.
+            bcp->stream_head++;
+            bcp->stream_len--;
+            continue;
+        }
+
+        if (bcp->stream_len < frame_len) {
+            return 0;
+        }
+
+        // the tag of an encrypted data frame is checked on the receive path
+        if (bcp->stream_sent == 0 && crc_len != 0 && !(is_data && bcp->aead != NULL)) {
+            uint32_t cur_crc = crc_trailer_get(data + frame_len - crc_len, crc_len);
+            if (frame_crc(data, frame_len - crc_len, crc_len) != cur_crc) {
+                k_log(BCP_LOG_WARN, "stream_frames_extract, crc error, frame_len : %d\n", frame_len);
+                bcp->stream_head++;
+                bcp->stream_len--;
+                continue;
+            }
+        }
+
+        if (stream_frame_deliver(bcp_block, data, frame_len) != 0) {
+            *held_len = frame_len;
+            return -1;
+        }
+        bcp->stream_head += frame_len;
+        bcp->stream_len -= frame_len;
+    }
+
+    bcp->stream_head = 0;
+    return 0;
+}
+
+int32_t bcp_input_stream(bcp_block_t *bcp_block, const void *data, uint32_t len)
+{
+    bcp_t *bcp = bcp_block->bcp;
+    if (bcp->stream_buf == NULL) {
+        k_log(BCP_LOG_ERROR, "bcp_input_stream, bcp is not in byte stream mode\n");
+        return -1;
+    }
+
+    const uint8_t *src = (const uint8_t *)data;
+    uint32_t consumed = 0;
+    uint32_t held_len = 0;
+    while (consumed < len) {
+        if (bcp->stream_head > 0) {
+            memmove(bcp->stream_buf, bcp->stream_buf + bcp->stream_head, bcp->stream_len);
+            bcp->stream_head = 0;
+        }
+
+        uint32_t copy_len = bcp->mfs - bcp->stream_len;
+        copy_len = copy_len > len - consumed ? len - consumed : copy_len;
+        memcpy(bcp->stream_buf + bcp->stream_len, src + consumed, copy_len);
+        bcp->stream_len += copy_len;
+        consumed += copy_len;
+
+        if (stream_frames_extract(bcp_block, &held_len) != 0) {
+            break;
+        }
+    }
+
+    // A frame the busy block refused is never left complete in the buffer.
+    // Its last byte and what follows go back to the caller, who sees fewer
+    // bytes consumed and inputs them again, which retries the frame.
+    if (held_len != 0) {
+        uint32_t give_back = bcp->stream_len - (held_len - 1);
+        bcp->stream_len -= give_back;
+        consumed -= give_back;
+    }
+
+    return consumed;
+}
+
+//---------------------------------------------------------------------
+// arena
+//---------------------------------------------------------------------
+typedef struct {
+    uint8_t *base;              // NULL while only measuring
+    uint32_t offset;
+} bcp_arena_t;
+
+typedef struct {
+    bcp_block_t *bcp_block;
+    bcp_t *bcp;
+    uint8_t *stream_buf;
+    uint8_t *frame_pool_mem;
+    uint8_t *mtu_pool_mem;
+    uint8_t *snd_list_pool_mem;
+    uint8_t *mfs_buf;
+    uint8_t *mal_buf;
+    frame_t **retx_ring;
+    uint16_t retx_ring_size;
+    aead_session_t *aead;
+    lz_session_t *lz;
+    bcp_lz_enc_t *lz_enc;
+    uint8_t *lz_tx_buf;
+    uint8_t *lz_rx_buf;
+    uint8_t *agg_buf;
+    uint8_t *fast_slots;
+} bcp_arena_parts_t;
+
+static uint8_t *arena_take(bcp_arena_t *arena, uint32_t size)
+{
+    uint32_t offset = (arena->offset + BCP_ARENA_ALIGN - 1) & ~(BCP_ARENA_ALIGN - 1);
+    arena->offset = offset + size;
+    return (arena->base != NULL && size > 0) ? arena->base + offset : NULL;
+}
+
+// Takes size bytes starting on a cache line. The worst case padding is
+// always taken, so measuring and carving walk the same offsets whatever
+// the address of the arena.
+static uint8_t *arena_take_line(bcp_arena_t *arena, uint32_t size)
+{
+    uint8_t *mem = arena_take(arena, size + BCP_CACHE_LINE - 1);
+    if (mem == NULL) {
+        return NULL;
+    }
+    return (uint8_t *)(((uintptr_t)mem + BCP_CACHE_LINE - 1) & ~(uintptr_t)(BCP_CACHE_LINE - 1));
+}
+
+static uint32_t pool_chunk_max(uint32_t block_num, uint32_t ceiling)
+{
+    uint32_t chunk_max = (ceiling + block_num - 1) / block_num;
+    while (chunk_max > 1 && (chunk_max > MEM_POOL_CHUNK_MAX || block_num * chunk_max >= MEM_POOL_INDEX_NONE)) {
+        chunk_max--;
+    }
+    return chunk_max > 0 ? chunk_max : 1;
+}
+
+// Initial block number and growth limit of each private pool. An elastic
+// pool starts with one chunk and grows by the same amount, a static arena
+// keeps the fixed sizes since it must never touch the heap.
+static void bcp_pool_plan(const bcp_parm_t *bcp_parm, uint8_t static_mem,
+                          uint32_t block_num[BCP_POOL_NUM], uint32_t chunk_max[BCP_POOL_NUM])
+{
+    uint32_t mfs = bcp_parm->mtu * bcp_parm->mfs_scale;
+
+    for (uint32_t i = 0; i < BCP_POOL_NUM; i++) {
+        chunk_max[i] = 1;
+    }
+
+    // with a shared slab the private pools stay empty
+    if (bcp_parm->slab != NULL) {
+        for (uint32_t i = 0; i < BCP_POOL_NUM; i++) {
+            block_num[i] = 0;
+        }
+        return;
+    }
+
+    block_num[BCP_POOL_FRAME] = (bcp_parm->mal/mfs + 1) * 4;
+    block_num[BCP_POOL_MTU] = bcp_parm->mfs_scale * 2;
+    block_num[BCP_POOL_SND_LIST] = 3;
+
+    if (static_mem) {
+        return;
+    }
+
+    if (bcp_parm->frame_pool_max > 0) {
+        block_num[BCP_POOL_FRAME] = bcp_parm->mal/mfs + 1;
+        chunk_max[BCP_POOL_FRAME] = pool_chunk_max(block_num[BCP_POOL_FRAME], bcp_parm->frame_pool_max);
+    }
+
+    if (bcp_parm->mtu_pool_max > 0) {
+        chunk_max[BCP_POOL_MTU] = pool_chunk_max(block_num[BCP_POOL_MTU], bcp_parm->mtu_pool_max);
+    }
+}
+
+static uint16_t fast_slot_stride(uint16_t mtu)
+{
+    return (sizeof(frame_t) + mtu + BCP_ARENA_ALIGN - 1) & ~(BCP_ARENA_ALIGN - 1);
+}
+
+// Carves every buffer of a bcp out of one arena, the same walk measures
+// the arena when arena->base is NULL. The receive buffers are only part
+// of a static arena, on the heap they follow the peer mfs at sync time.
+// The private pools go to pool_arena, which may be the arena itself.
+static uint32_t bcp_arena_layout(const bcp_parm_t *bcp_parm, bcp_arena_t *arena, bcp_arena_t *pool_arena,
+                                 uint8_t with_rx_buf, bcp_arena_parts_t *parts)
+{
+    uint32_t mfs = bcp_parm->mtu * bcp_parm->mfs_scale;
+    uint32_t block_num[BCP_POOL_NUM], chunk_max[BCP_POOL_NUM];
+    bcp_pool_plan(bcp_parm, with_rx_buf, block_num, chunk_max);
+
+    parts->bcp_block = (bcp_block_t *)arena_take(arena, sizeof(bcp_block_t));
+    parts->bcp = (bcp_t *)arena_take_line(arena, sizeof(bcp_t));
+    parts->stream_buf = arena_take(arena, bcp_parm->byte_stream ? mfs : 0);
+    parts->frame_pool_mem = arena_take(pool_arena, mem_pool_mem_size(mfs + sizeof(frame_t), block_num[BCP_POOL_FRAME]));
+    parts->mtu_pool_mem = arena_take(pool_arena, mem_pool_mem_size(bcp_parm->mtu + sizeof(mtu_t), block_num[BCP_POOL_MTU]));
+    parts->snd_list_pool_mem = arena_take(pool_arena, mem_pool_mem_size(sizeof(queue_node_t), block_num[BCP_POOL_SND_LIST]));
+    parts->lz_enc = (bcp_lz_enc_t *)arena_take(pool_arena, bcp_parm->compress ? sizeof(bcp_lz_enc_t) : 0);
+    parts->lz_tx_buf = arena_take(pool_arena, bcp_parm->compress ? bcp_parm->mal + BCP_LZ_HEAD_LEN : 0);
+    parts->lz_rx_buf = arena_take(pool_arena, bcp_parm->compress ? bcp_parm->mal : 0);
+    parts->mfs_buf = arena_take(arena, with_rx_buf ? mfs : 0);
+    parts->mal_buf = arena_take(arena, with_rx_buf ? bcp_parm->mal + (bcp_parm->compress ? BCP_LZ_HEAD_LEN : 0) : 0);
+
+    // one slot per frame that can be in flight plus the sync frame, the
+    // fsn window of fsn_diff bounds it for a shared slab
+    uint32_t in_flight = block_num[BCP_POOL_FRAME] * chunk_max[BCP_POOL_FRAME] + 1;
+    parts->retx_ring_size = 1;
+    while (parts->retx_ring_size < in_flight && parts->retx_ring_size < BCP_RETX_RING_MAX) {
+        parts->retx_ring_size <<= 1;
+    }
+    if (bcp_parm->slab != NULL) {
+        parts->retx_ring_size = BCP_RETX_RING_MAX;
+    }
+    parts->retx_ring = (frame_t **)arena_take(arena, sizeof(frame_t *) * parts->retx_ring_size);
+    parts->aead = (aead_session_t *)arena_take(arena, bcp_parm->aead_key ? sizeof(aead_session_t) : 0);
+    parts->lz = (lz_session_t *)arena_take(arena, bcp_parm->compress ? sizeof(lz_session_t) : 0);
+    parts->agg_buf = arena_take(arena, bcp_parm->aggregate_ms ? bcp_parm->mtu : 0);
+    parts->fast_slots = arena_take(arena, fast_slot_stride(bcp_parm->mtu) * BCP_FAST_SLOT_NUM);
+
+    return arena->offset;
+}
+
+uint32_t bcp_arena_size(const bcp_parm_t *bcp_parm)
+{
+    bcp_arena_t arena = {NULL, 0};
+    bcp_arena_parts_t parts;
+
+    // slack to align an arbitrary caller buffer
+    return bcp_arena_layout(bcp_parm, &arena, &arena, 1, &parts) + BCP_ARENA_ALIGN - 1;
+}
+
+// Lays the private pools and the compression buffers out on a fresh pool
+// arena, in the order of bcp_arena_layout.
+static void bcp_pools_attach(bcp_t *bcp, uint8_t *mem)
+{
+    bcp_arena_t arena = {mem, 0};
+    mem_pool_t *mem_pools[BCP_POOL_NUM] = {&bcp->frame_mem_pool, &bcp->mtu_mem_pool, &bcp->snd_list_pool};
+
+    for (uint32_t i = 0; i < BCP_POOL_NUM; i++) {
+        uint8_t *pool_mem = arena_take(&arena, mem_pool_mem_size(mem_pools[i]->block_size, mem_pools[i]->block_num));
+        mem_pool_attach(mem_pools[i], pool_mem);
+    }
+
+    if (bcp->lz != NULL) {
+        bcp->lz->enc = (bcp_lz_enc_t *)arena_take(&arena, sizeof(bcp_lz_enc_t));
+        bcp->lz->tx_buf = arena_take(&arena, bcp->mal + BCP_LZ_HEAD_LEN);
+        bcp->lz->rx_buf = arena_take(&arena, bcp->mal);
+        // the encoder starts over, the peer is told with the next message
+        atomic_store_explicit(&bcp->lz->tx_reset, 1, memory_order_relaxed);
     }
+}
 
+// pool_mem holds the private pools apart from mem, NULL to keep them in mem.
+static bcp_block_t *bcp_create_on(const bcp_parm_t *bcp_parm, const bcp_interface_t *bcp_interface,
+                                  const void *user_data, uint8_t *mem, uint8_t *pool_mem, uint8_t static_mem)
+{
+    bcp_arena_t arena = {mem, 0};
+    bcp_arena_t pool_arena = {pool_mem, 0};
+    bcp_arena_parts_t parts;
+    bcp_arena_layout(bcp_parm, &arena, pool_mem ? &pool_arena : &arena, static_mem, &parts);
+
+    bcp_block_t *bcp_block = parts.bcp_block;
+    bcp_block->bcp = parts.bcp;
     bcp_t *bcp = bcp_block->bcp;
 
     if (bcp_adapter.bcp_critical.critical_section_create(&bcp->critical_section) != 0) {
@@ -889,94 +3608,322 @@ bcp_block_t *bcp_create(const bcp_parm_t *bcp_parm, const bcp_interface_t *bcp_i
 
     bcp_block->user_data = (void *)user_data;
     bcp->owner = bcp_block;
+    bcp->heap_mem = static_mem ? NULL : mem;
+    bcp->pool_mem = pool_mem;
+    bcp->pool_mem_size = pool_arena.offset;
+    bcp->static_mem = static_mem;
 
     bcp->mal = bcp_parm->mal;
     bcp->mtu = bcp_parm->mtu;
     bcp->mfs = bcp_parm->mtu*bcp_parm->mfs_scale;
 
-    // delay malloc after recv sync frame
-    bcp->mal_buf = NULL;
-    bcp->mfs_buf = NULL;
+    // on the heap the buffers grow with the received messages
+    bcp->mal_buf = parts.mal_buf;
+    bcp->mfs_buf = parts.mfs_buf;
+    bcp->mal_buf_size = static_mem ? bcp->mal + (bcp_parm->compress ? BCP_LZ_HEAD_LEN : 0) : 0;
+    bcp->mfs_buf_size = static_mem ? bcp->mfs : 0;
+    bcp->peer_mfs = 0;
+
+    bcp->stream_buf = parts.stream_buf;
+    bcp->stream_head = 0;
+    bcp->stream_len = 0;
+    bcp->stream_sent = 0;
+
+    bcp->slab = bcp_parm->slab;
+    bcp->slab_quota = bcp_parm->slab_quota;
+    atomic_init(&bcp->slab_used, 0);
+
+    uint32_t block_num[BCP_POOL_NUM], chunk_max[BCP_POOL_NUM];
+    bcp_pool_plan(bcp_parm, static_mem, block_num, chunk_max);
+
+    if (mem_pool_init_on(&bcp->frame_mem_pool, bcp->mfs + sizeof(frame_t), block_num[BCP_POOL_FRAME],
+                         chunk_max[BCP_POOL_FRAME], parts.frame_pool_mem) < 0) {
+        k_log(BCP_LOG_ERROR, "bcp create, frame_mem_pool init failed\n");
+        goto mem_pool_init_fail;
+    }
+
+    if (mem_pool_init_on(&bcp->mtu_mem_pool, bcp->mtu + sizeof(mtu_t), block_num[BCP_POOL_MTU],
+                         chunk_max[BCP_POOL_MTU], parts.mtu_pool_mem) < 0) {
+        k_log(BCP_LOG_ERROR, "bcp create, mtu_mem_pool init failed\n");
+        goto mem_pool_init_fail;
+    }
+
+    if (mem_pool_init_on(&bcp->snd_list_pool, sizeof(queue_node_t), block_num[BCP_POOL_SND_LIST],
+                         chunk_max[BCP_POOL_SND_LIST], parts.snd_list_pool_mem) < 0) {
+        k_log(BCP_LOG_ERROR, "bcp create, snd_list_pool init failed\n");
+        goto mem_pool_init_fail;
+    }
+
+    for (uint32_t i = 0; i < BCP_EVENT_LANE_NUM; i++) {
+        event_ring_init(&bcp->event_ring[i]);
+    }
+    atomic_init(&bcp->worker_parked, 0);
+
+    bcp->retx_ring = parts.retx_ring;
+    bcp->retx_mask = parts.retx_ring_size - 1;
+    bcp->retx_count = 0;
+    bcp->retx_head = 0;
+    queue_init(&bcp->retx_wait);
+    memset(bcp->retx_ring, 0, sizeof(frame_t *) * parts.retx_ring_size);
+
+    bcp->snd_next = 0;
+    bcp->rcv_next = 0;
+    bcp->status = BCP_STOP;
+    bcp->exit_cmd = 0;
+    bcp->exit_flag = 0;
+    bcp->work_mode = bcp_parm->work_mode;
+    bcp->executor = bcp_parm->executor;
+    bcp->scheduled = 0;
+    bcp->pending_events = 0;
+    atomic_init(&bcp->deadline_active, 0);
+    bcp->deadline_ms = 0;
+    bcp->wake_queue = NULL;
+    bcp->session_gate = NULL;
+    bcp->work_thread = NULL;
+    bcp->timer = NULL;
+
+    bcp->hibernate_ms = bcp_parm->hibernate_ms;
+    atomic_init(&bcp->crc_len, 2);
+    atomic_init(&bcp->link_caps, 0);
+    bcp->recv_trailer_len = 0;
+    bcp->recv_msg_lost = 0;
+
+    bcp->aead = parts.aead;
+    if (bcp->aead != NULL) {
+        memset(bcp->aead, 0, sizeof(aead_session_t));
+        memcpy(bcp->aead->key, bcp_parm->aead_key, BCP_AEAD_KEY_LEN);
+        bcp_adapter.bcp_random.random_fill(bcp->aead->tx_salt, BCP_AEAD_SALT_LEN);
+        bcp_adapter.bcp_random.random_fill(bcp->aead->rx_bind, BCP_AEAD_SALT_LEN);
+        atomic_init(&bcp->aead->tx_gen, 0);
+        atomic_init(&bcp->aead->tx_seq, 0);
+    }
+
+    bcp->lz = parts.lz;
+    if (bcp->lz != NULL) {
+        bcp->lz->enc = parts.lz_enc;
+        bcp_lz_enc_reset(bcp->lz->enc);
+        bcp_lz_dict_reset(&bcp->lz->rx);
+        atomic_init(&bcp->lz->on, 0);
+        atomic_init(&bcp->lz->tx_reset, 1);
+        bcp->lz->rx_lost = 0;
+        bcp->lz->tx_buf = parts.lz_tx_buf;
+        bcp->lz->rx_buf = parts.lz_rx_buf;
+    }
 
-    if (mem_pool_init(&bcp->frame_mem_pool, bcp->mfs + sizeof(frame_t), (bcp->mal/bcp->mfs + 1) * 4) < 0) {
-        k_log(BCP_LOG_ERROR, "bcp create, frame_mem_pool init failed\n");
-        goto frame_mem_pool_init_fail;
+    bcp->sync_offer = (bcp_parm->crc32c ? BCP_SYNC_FLAG_CRC32C : 0) |
+                      (bcp->aead != NULL ? BCP_SYNC_FLAG_AEAD : 0) |
+                      ((bcp_parm->transport & BCP_TRANSPORT_INTEGRITY) ? BCP_SYNC_FLAG_INTEGRITY : 0) |
+                      ((bcp_parm->transport & BCP_TRANSPORT_RELIABLE) ? BCP_SYNC_FLAG_RELIABLE : 0) |
+                      (bcp->lz != NULL ? BCP_SYNC_FLAG_LZ : 0) |
+                      (bcp_parm->aggregate_ms ? BCP_SYNC_FLAG_AGGREGATE : 0) |
+                      (bcp_parm->wide_len ? BCP_SYNC_FLAG_WIDE : 0);
+    atomic_init(&bcp->wide_len, 0);
+
+    // an aggregate goes in one packet whatever trailer and length are agreed
+    uint8_t agg_extra = data_frame_extra(bcp);
+    atomic_init(&bcp->agg_max, 0);
+    bcp->agg_ms = bcp_parm->aggregate_ms;
+    bcp->agg_cap = bcp->agg_ms && bcp->mtu > agg_extra ? bcp->mtu - agg_extra : 0;
+    bcp->agg_len = 0;
+    bcp->agg_count = 0;
+    bcp->agg_timer_on = 0;
+    bcp->agg_deadline_ms = 0;
+    bcp->agg_buf = parts.agg_buf;
+    bcp->agg_frame = NULL;
+
+    bcp->fast_slots = parts.fast_slots;
+    bcp->fast_stride = fast_slot_stride(bcp->mtu);
+    atomic_init(&bcp->fast_head, 0);
+    for (uint32_t i = 0; i < BCP_FAST_SLOT_NUM; i++) {
+        atomic_init(&bcp->fast_busy[i], 0);
     }
+    atomic_init(&bcp->session_state, BCP_SESSION_ACTIVE);
+    atomic_init(&bcp->session_users, 0);
+    atomic_init(&bcp->last_active_ms, bcp_adapter.bcp_time.get_ms());
 
-    if (mem_pool_init(&bcp->mtu_mem_pool, bcp->mtu + sizeof(mtu_t), bcp_parm->mfs_scale * 2) < 0) {
-        k_log(BCP_LOG_ERROR, "bcp create, mtu_mem_pool init failed\n");
-        goto mtu_mem_pool_init_fail;
+    bcp->output = bcp_interface->output;
+    bcp->output_batch = bcp_interface->output_batch;
+    bcp->data_listener = bcp_interface->data_listener;
+    bcp->opened_listener = NULL;
+    bcp->event_notify = bcp_interface->event_notify;
+
+    if (bcp->hibernate_ms != 0 &&
+        bcp_adapter.bcp_queue.queue_create(&bcp->session_gate, 1, sizeof(uint8_t)) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp create, session gate create failed\n");
+        goto session_gate_create_fail;
     }
 
-    if (mem_pool_init(&bcp->snd_list_pool, sizeof(queue_node_t), 3) < 0) {
-        k_log(BCP_LOG_ERROR, "bcp create, snd_list_pool init failed\n");
-        goto snd_list_pool_init_fail;
+    // The host drives the block, no thread and no timer are needed.
+    if (bcp->work_mode == BCP_WORK_MODE_EXTERNAL) {
+        k_log(BCP_LOG_TRACE, "bcp create successful, external mode\n");
+        return bcp_block;
     }
 
-    if (bcp_adapter.bcp_queue.queue_create(&bcp->queue, 5, sizeof(bcp_context_t)) != 0) {
-        k_log(BCP_LOG_ERROR, "bcp create, queue create failed\n");
-        goto bcp_queue_create_fail;
+    if (bcp->work_mode == BCP_WORK_MODE_EXECUTOR && executor_attach(bcp->executor) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp create, executor serves session_num sessions already\n");
+        goto executor_attach_fail;
     }
 
-    bcp_thread_config_t thread_config = {
-        .thread_name = bcp_parm->work_thread_name,
-        .thread_priority = bcp_parm->work_thread_priority,
-        .thread_stack_size = bcp_parm->work_thread_stack_size,
-        .thread_func = bcp_thread_handler,
-        .arg = bcp,
-    };
-    if (bcp_adapter.bcp_thread.thread_create(&bcp->work_thread, &thread_config) != 0) {
-        k_log(BCP_LOG_ERROR, "bcp create, work thread create failed\n");
-        goto bcp_thread_create_fail;
+    if (bcp->work_mode == BCP_WORK_MODE_THREAD) {
+        if (bcp_adapter.bcp_queue.queue_create(&bcp->wake_queue, 1, sizeof(uint8_t)) != 0) {
+            k_log(BCP_LOG_ERROR, "bcp create, wake queue create failed\n");
+            goto wake_queue_create_fail;
+        }
+
+        // kept to spawn the thread again after hibernation
+        bcp->work_thread_config.thread_name = bcp_parm->work_thread_name;
+        bcp->work_thread_config.thread_priority = bcp_parm->work_thread_priority;
+        bcp->work_thread_config.thread_stack_size = bcp_parm->work_thread_stack_size;
+        bcp->work_thread_config.thread_func = bcp_thread_handler;
+        bcp->work_thread_config.arg = bcp;
+        if (bcp_adapter.bcp_thread.thread_create(&bcp->work_thread, &bcp->work_thread_config) != 0) {
+            k_log(BCP_LOG_ERROR, "bcp create, work thread create failed\n");
+            goto bcp_thread_create_fail;
+        }
     }
 
     if (bcp_adapter.bcp_timer.timer_create(&bcp->timer, bcp_timer_tomeout_handler, bcp) != 0) {
         k_log(BCP_LOG_ERROR, "bcp create, timer create failed\n");
         goto bcp_timer_create_fail;
     }
-
-    queue_init(&bcp->ack_list);
-
-    bcp->snd_next = 0;
-    bcp->rcv_next = 0;
-    bcp->status = BCP_STOP;
-    bcp->exit_cmd = 0;
-    bcp->exit_flag = 0;
-
-    bcp->output = bcp_interface->output;
-    bcp->data_listener = bcp_interface->data_listener;
+    session_idle_timer_start(bcp);
 
     k_log(BCP_LOG_TRACE, "bcp create successful\n");
     
     return bcp_block;
 
 bcp_timer_create_fail:
-    bcp_adapter.bcp_thread.thread_destory(&bcp->work_thread);
+    if (bcp->work_thread) {
+        bcp_adapter.bcp_thread.thread_destory(&bcp->work_thread);
+    }
 
 bcp_thread_create_fail:
-    bcp_adapter.bcp_queue.queue_destory(&bcp->queue);
-
-bcp_queue_create_fail:
-    mem_pool_deinit(&bcp->snd_list_pool);
+    if (bcp->wake_queue) {
+        bcp_adapter.bcp_queue.queue_destory(&bcp->wake_queue);
+    }
 
-snd_list_pool_init_fail:
-    mem_pool_deinit(&bcp->mtu_mem_pool);
+wake_queue_create_fail:
+    if (bcp->work_mode == BCP_WORK_MODE_EXECUTOR) {
+        executor_detach(bcp->executor);
+    }
 
-mtu_mem_pool_init_fail:
-    mem_pool_deinit(&bcp->frame_mem_pool);
+executor_attach_fail:
+    if (bcp->session_gate) {
+        bcp_adapter.bcp_queue.queue_destory(&bcp->session_gate);
+    }
 
-frame_mem_pool_init_fail:
+session_gate_create_fail:
+mem_pool_init_fail:
     bcp_adapter.bcp_critical.critical_section_destory(&bcp->critical_section);
 bcp_critical_create_fail:
-    bcp_adapter.bcp_mem.bcp_free(bcp_block->bcp);
-    bcp_block->bcp = NULL;
-bcp_mem_fail:
-    bcp_adapter.bcp_mem.bcp_free(bcp_block);
-    bcp_block = NULL;
+    return NULL;
+}
+
+static uint8_t bcp_parm_check(const bcp_parm_t *bcp_parm, const bcp_interface_t *bcp_interface)
+{
+    if (bcp_parm->work_mode == BCP_WORK_MODE_EXECUTOR && bcp_parm->executor == NULL) {
+        k_log(BCP_LOG_ERROR, "bcp create, no executor\n");
+        return 0;
+    }
+
+    if (bcp_interface->output == NULL && bcp_interface->output_batch == NULL) {
+        k_log(BCP_LOG_ERROR, "bcp create, no output interface\n");
+        return 0;
+    }
+
+    if ((uint32_t)bcp_parm->mtu * bcp_parm->mfs_scale > BCP_NARROW_FRAME_MAX && !bcp_parm->wide_len) {
+        k_log(BCP_LOG_ERROR, "bcp create, frames over 64 KB need wide_len, mfs : %d\n", bcp_parm->mtu * bcp_parm->mfs_scale);
+        return 0;
+    }
+
+    // the SYNC_REQ with the high half of the mfs goes out in one mtu
+    if (bcp_parm->wide_len && bcp_parm->mtu < sizeof(bcp_frame_head_t) + sizeof(uint16_t) + 1 +
+                                              (bcp_parm->aead_key != NULL ? BCP_AEAD_SALT_LEN : 0) + BCP_WIDE_LEN_LEN + 2) {
+        k_log(BCP_LOG_ERROR, "bcp create, mtu too small for wide lengths, mtu : %d\n", bcp_parm->mtu);
+        return 0;
+    }
+
+    if (bcp_parm->aead_key != NULL) {
+        if (bcp_adapter.bcp_random.random_fill == NULL) {
+            k_log(BCP_LOG_ERROR, "bcp create, encryption needs the random adapter\n");
+            return 0;
+        }
+        if ((uint32_t)bcp_parm->mtu * bcp_parm->mfs_scale <= sizeof(bcp_frame_head_t) + BCP_AEAD_SEQ_LEN + BCP_AEAD_TAG_LEN) {
+            k_log(BCP_LOG_ERROR, "bcp create, mfs too small for encrypted frames\n");
+            return 0;
+        }
+        // the SYNC_REQ with the salt goes out in one mtu
+        if (bcp_parm->mtu < sizeof(bcp_frame_head_t) + sizeof(uint16_t) + 1 + BCP_AEAD_SALT_LEN + 2) {
+            k_log(BCP_LOG_ERROR, "bcp create, mtu too small for the salt, mtu : %d\n", bcp_parm->mtu);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+bcp_block_t *bcp_create(const bcp_parm_t *bcp_parm, const bcp_interface_t *bcp_interface, const void *user_data)
+{
+    if (!bcp_parm_check(bcp_parm, bcp_interface)) {
+        return NULL;
+    }
 
+    // a session that may hibernate keeps its pools apart, they are released while it sleeps
+    bcp_arena_t arena = {NULL, 0};
+    bcp_arena_t pool_arena = {NULL, 0};
+    bcp_arena_parts_t parts;
+    uint32_t size = bcp_arena_layout(bcp_parm, &arena, bcp_parm->hibernate_ms ? &pool_arena : &arena, 0, &parts);
+    uint32_t pool_size = pool_arena.offset;
+
+    // refused when the memory budget is exhausted
+    uint8_t *mem = (uint8_t *)bcp_mem_alloc(size, BCP_MEM_ESSENTIAL);
+    if (mem == NULL) {
+        k_log(BCP_LOG_ERROR, "bcp create, bcp get mem fail\n");
+        return NULL;  
+    }
+
+    uint8_t *pool_mem = NULL;
+    if (pool_size > 0) {
+        pool_mem = (uint8_t *)bcp_mem_alloc(pool_size, BCP_MEM_ESSENTIAL);
+        if (pool_mem == NULL) {
+            k_log(BCP_LOG_ERROR, "bcp create, pool get mem fail\n");
+            goto pool_mem_fail;
+        }
+    }
+
+    bcp_block_t *bcp_block = bcp_create_on(bcp_parm, bcp_interface, user_data, mem, pool_mem, 0);
+    if (bcp_block == NULL) {
+        goto bcp_create_fail;
+    }
+    bcp_block->bcp->heap_size = size;
+
+    return bcp_block;
+
+bcp_create_fail:
+    bcp_mem_release(pool_mem, pool_size);
+pool_mem_fail:
+    bcp_mem_release(mem, size);
     return NULL;
 }
 
+bcp_block_t *bcp_create_static(const bcp_parm_t *bcp_parm, const bcp_interface_t *bcp_interface, const void *user_data,
+                               void *arena, uint32_t arena_size)
+{
+    if (!bcp_parm_check(bcp_parm, bcp_interface)) {
+        return NULL;
+    }
+
+    if (arena == NULL || arena_size < bcp_arena_size(bcp_parm)) {
+        k_log(BCP_LOG_ERROR, "bcp create static, arena is too small, size : %d\n", arena_size);
+        return NULL;
+    }
+
+    uintptr_t base = ((uintptr_t)arena + BCP_ARENA_ALIGN - 1) & ~(uintptr_t)(BCP_ARENA_ALIGN - 1);
+    memset(arena, 0, arena_size);
+
+    return bcp_create_on(bcp_parm, bcp_interface, user_data, (uint8_t *)base, NULL, 1);
+}
+
 
 static void bcp_exit_handle(bcp_t *bcp, const void *context) 
 {
@@ -991,77 +3938,402 @@ void bcp_destory(bcp_block_t *bcp_block)
     }
 
     if (bcp_block->bcp == NULL) {
-        bcp_adapter.bcp_mem.bcp_free(bcp_block);
         k_log(BCP_LOG_INFO, "bcp_destory, bcp is null\n");
         return;
     }
 
     bcp_t *bcp = bcp_block->bcp;
-    // before clean res
-    bcp_adapter.bcp_timer.timer_destory(&bcp->timer);
 
-    if (bcp_event_post(bcp, NULL, bcp_exit_handle) != 0) {
-        k_log(BCP_LOG_ERROR, "bcp_destory, post fail\n");
-        bcp->exit_cmd = 1;
+    // A hibernated session has no timer, work thread or pools left and is
+    // torn down as it sleeps. Any other is kept awake for the usual teardown.
+    uint8_t asleep = 0;
+    if (bcp->hibernate_ms != 0) {
+        uint8_t state = atomic_load(&bcp->session_state);
+        while (state == BCP_SESSION_DRAINING || state == BCP_SESSION_WAKING) {
+            session_gate_wait(bcp);
+            state = atomic_load(&bcp->session_state);
+        }
+        asleep = state == BCP_SESSION_ASLEEP &&
+                 atomic_compare_exchange_strong(&bcp->session_state, &state, BCP_SESSION_WAKING);
     }
 
-    uint8_t count = 0;
-    do {
-        bcp_adapter.bcp_time.delay_ms(10);
-    } while (count < 3 && bcp->exit_flag == 0);
+    if (!asleep && bcp_session_enter(bcp) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp_destory, resume fail\n");
+    }
 
-    if (bcp->exit_flag == 0) {
-        bcp_adapter.bcp_thread.thread_destory(&bcp->work_thread);
+    if (!asleep && bcp->work_mode != BCP_WORK_MODE_EXTERNAL) {
+        // before clean res
+        bcp_adapter.bcp_timer.timer_destory(&bcp->timer);
+
+        if (bcp_event_post(bcp, NULL, bcp_exit_handle) != 0) {
+            k_log(BCP_LOG_ERROR, "bcp_destory, post fail\n");
+            bcp->exit_cmd = 1;
+        }
+
+        uint8_t count = 0;
+        do {
+            bcp_adapter.bcp_time.delay_ms(10);
+        } while (count < 3 && bcp->exit_flag == 0);
+
+        if (bcp->exit_flag == 0 && bcp->work_thread) {
+            bcp_adapter.bcp_thread.thread_destory(&bcp->work_thread);
+        }
+    }
+
+    if (bcp->work_mode == BCP_WORK_MODE_EXECUTOR) {
+        executor_detach(bcp->executor);
     }
     
-    bcp_adapter.bcp_queue.queue_destory(&bcp->queue);
-    mem_pool_deinit(&bcp->snd_list_pool);
-    mem_pool_deinit(&bcp->mtu_mem_pool);
-    mem_pool_deinit(&bcp->frame_mem_pool);
+    if (bcp->wake_queue) {
+        bcp_adapter.bcp_queue.queue_destory(&bcp->wake_queue);
+    }
+    if (bcp->session_gate) {
+        bcp_adapter.bcp_queue.queue_destory(&bcp->session_gate);
+    }
     bcp_adapter.bcp_critical.critical_section_destory(&bcp->critical_section);
-    bcp_adapter.bcp_mem.bcp_free(bcp->mal_buf);
-    bcp_adapter.bcp_mem.bcp_free(bcp->mfs_buf);
-    bcp_adapter.bcp_mem.bcp_free(bcp);
+
+    // the pools and the stream buffer live in the arena, only grown chunks do not
+    mem_pool_chunks_free(&bcp->frame_mem_pool);
+    mem_pool_chunks_free(&bcp->mtu_mem_pool);
+    mem_pool_chunks_free(&bcp->snd_list_pool);
+    uint8_t *heap_mem = bcp->heap_mem;
+    uint32_t heap_size = bcp->heap_size;
+    if (heap_mem != NULL) {
+        bcp_mem_release(bcp->pool_mem, bcp->pool_mem_size);
+        rx_bufs_release(bcp);
+    }
     bcp_block->bcp = NULL;
-    bcp_adapter.bcp_mem.bcp_free(bcp_block);
+    bcp_mem_release(heap_mem, heap_size);
 
     k_log(BCP_LOG_INFO, "bcp_destory ok\n");
 }
 
+//---------------------------------------------------------------------
+// session table
+//---------------------------------------------------------------------
+bcp_table_t *bcp_table_create(const bcp_parm_t *bcp_parm, uint32_t session_num)
+{
+    if (session_num == 0 || bcp_parm->hibernate_ms != 0) {
+        k_log(BCP_LOG_ERROR, "bcp table create, invalid parm\n");
+        return NULL;
+    }
+
+    uint32_t slot_size = (bcp_arena_size(bcp_parm) + BCP_CACHE_LINE - 1) & ~(uint32_t)(BCP_CACHE_LINE - 1);
+    uint32_t head_size = sizeof(bcp_table_t) + sizeof(bcp_block_t *) * session_num + BCP_CACHE_LINE - 1;
+    if (session_num > (UINT32_MAX - head_size) / slot_size) {
+        k_log(BCP_LOG_ERROR, "bcp table create, table too large, session_num : %d\n", session_num);
+        return NULL;
+    }
+
+    uint32_t mem_size = head_size + slot_size * session_num;
+    uint8_t *mem = (uint8_t *)bcp_mem_alloc(mem_size, BCP_MEM_ESSENTIAL);
+    if (mem == NULL) {
+        k_log(BCP_LOG_ERROR, "bcp table create, table get mem fail\n");
+        return NULL;
+    }
+    memset(mem, 0, head_size);
+
+    bcp_table_t *table = (bcp_table_t *)mem;
+    table->bcp_parm = *bcp_parm;
+    table->session_num = session_num;
+    table->slot_size = slot_size;
+    table->mem_size = mem_size;
+    table->blocks = (bcp_block_t **)(mem + sizeof(bcp_table_t));
+
+    uintptr_t slots = (uintptr_t)(table->blocks + session_num);
+    table->slots = (uint8_t *)((slots + BCP_CACHE_LINE - 1) & ~(uintptr_t)(BCP_CACHE_LINE - 1));
+
+    k_log(BCP_LOG_TRACE, "bcp table create successful, slot_size : %d\n", slot_size);
+
+    return table;
+}
+
+static uint8_t bcp_table_slot_busy(const bcp_table_t *table, uint32_t index)
+{
+    // bcp_destory clears bcp, the block itself stays in the slot
+    return table->blocks[index] != NULL && table->blocks[index]->bcp != NULL;
+}
+
+bcp_block_t *bcp_table_block_create(bcp_table_t *table, uint32_t index, const bcp_interface_t *bcp_interface,
+                                    const void *user_data)
+{
+    if (table == NULL || index >= table->session_num) {
+        k_log(BCP_LOG_ERROR, "bcp table block create, invalid index : %d\n", index);
+        return NULL;
+    }
+
+    if (bcp_table_slot_busy(table, index)) {
+        k_log(BCP_LOG_ERROR, "bcp table block create, slot %d in use\n", index);
+        return NULL;
+    }
+
+    table->blocks[index] = bcp_create_static(&table->bcp_parm, bcp_interface, user_data,
+                                             table->slots + table->slot_size * index, table->slot_size);
+    return table->blocks[index];
+}
+
+void bcp_table_destory(bcp_table_t *table)
+{
+    if (table == NULL) {
+        k_log(BCP_LOG_INFO, "bcp_table_destory, table is null\n");
+        return;
+    }
+
+    for (uint32_t i = 0; i < table->session_num; i++) {
+        if (bcp_table_slot_busy(table, i)) {
+            bcp_destory(table->blocks[i]);
+        }
+    }
+    bcp_mem_release(table, table->mem_size);
+
+    k_log(BCP_LOG_INFO, "bcp_table_destory ok\n");
+}
+
+int32_t bcp_pool_stats_get(bcp_block_t *bcp_block, bcp_pool_id_t pool_id, bcp_pool_stats_t *stats)
+{
+    bcp_t *bcp = bcp_block->bcp;
+    if (bcp->slab != NULL) {
+        return -1;
+    }
+
+    mem_pool_t *mem_pool = NULL;
+    if (pool_id == BCP_POOL_FRAME) {
+        mem_pool = &bcp->frame_mem_pool;
+    } else if (pool_id == BCP_POOL_MTU) {
+        mem_pool = &bcp->mtu_mem_pool;
+    } else if (pool_id == BCP_POOL_SND_LIST) {
+        mem_pool = &bcp->snd_list_pool;
+    } else {
+        return -2;
+    }
+
+    stats->block_size = mem_pool->block_size;
+    stats->capacity = atomic_load(&mem_pool->chunk_live) * mem_pool->block_num;
+    stats->ceiling = mem_pool->chunk_max * mem_pool->block_num;
+    stats->in_use = atomic_load_explicit(&mem_pool->in_use, memory_order_relaxed);
+    stats->high_watermark = atomic_load_explicit(&mem_pool->high_watermark, memory_order_relaxed);
+    stats->grow_count = mem_pool->grow_count;
+    stats->shrink_count = mem_pool->shrink_count;
+    stats->alloc_fail = atomic_load_explicit(&mem_pool->alloc_fail, memory_order_relaxed);
+
+    return 0;
+}
+
 int32_t bcp_open(bcp_block_t *bcp_block, void (*opened_cb)(const bcp_block_t *bcp_block, bcp_open_status_t status), uint32_t timeout_ms)
 {
     bcp_t *bcp = bcp_block->bcp;
+    if (bcp_session_enter(bcp) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp_open, resume fail\n");
+        return -1;
+    }
+
     bcp->opened_listener = opened_cb;
     bcp->sync_timeout_ms = timeout_ms;
-    return bcp_event_post_prior(bcp, NULL, sync_frame_send_handle);
+    int32_t ret = bcp_event_post_prior(bcp, NULL, sync_frame_send_handle);
+    bcp_session_leave(bcp);
+
+    return ret;
 }
 
-// single thread used
-int32_t bcp_send(bcp_block_t *bcp_block, void *data, uint32_t len)
+int32_t bcp_process(bcp_block_t *bcp_block)
 {
     bcp_t *bcp = bcp_block->bcp;
-    if (len > bcp->mal) {
-        k_log(BCP_LOG_ERROR, "bcp_send, len is too loog, len : %d\n", len);
+    if (bcp->work_mode != BCP_WORK_MODE_EXTERNAL) {
+        k_log(BCP_LOG_ERROR, "bcp_process, bcp is not in external mode\n");
         return -1;
     }
 
-    if (bcp_block == NULL || bcp_block->bcp == NULL) {
-        k_log(BCP_LOG_ERROR, "bcp_send, bcp_block == NULL || bcp_block->bcp == NULL, len : %d\n", len);
-        return -2;
+    int32_t count = 0;
+    bcp_context_t bcp_context;
+    while (bcp_event_recv(bcp, &bcp_context) == 0) {
+        if (bcp_context.event_handler) {
+            bcp_context.event_handler(bcp, bcp_context.context);
+        }
+        count++;
+    }
+    agg_flush_due(bcp);
+    bcp_pools_trim(bcp);
+
+    if (atomic_load_explicit(&bcp->deadline_active, memory_order_acquire) &&
+        (int32_t)(bcp_adapter.bcp_time.get_ms() - bcp->deadline_ms) >= 0) {
+        atomic_store(&bcp->deadline_active, 0);
+        sync_frame_timeout_handle(bcp, NULL);
+        count++;
     }
 
-    if (bcp->status != BCP_DONE) {
-        k_log(BCP_LOG_ERROR, "bcp_send, bcp is not ready, status : %d\n", bcp->status);
-        return -2;
+    if (bcp_session_idle_due(bcp)) {
+        bcp_session_hibernate(bcp, NULL);
+    }
+
+    return count;
+}
+
+uint32_t bcp_next_deadline_ms(bcp_block_t *bcp_block)
+{
+    bcp_t *bcp = bcp_block->bcp;
+    uint32_t deadline = BCP_NO_DEADLINE;
+    if (bcp->hibernate_ms != 0 && atomic_load(&bcp->session_state) == BCP_SESSION_ACTIVE) {
+        deadline = bcp_session_idle_left(bcp);
+    }
+    deadline = agg_wait_ms(bcp, deadline);
+
+    if (!atomic_load_explicit(&bcp->deadline_active, memory_order_acquire)) {
+        return deadline;
+    }
+
+    int32_t left = (int32_t)(bcp->deadline_ms - bcp_adapter.bcp_time.get_ms());
+    left = left > 0 ? left : 0;
+    return (uint32_t)left < deadline ? (uint32_t)left : deadline;
+}
+
+// Fills the frames of a message in order.
+static void snd_list_pack(bcp_t *bcp, queue_node_t *snd_list, uint8_t *data, uint32_t len, uint32_t count,
+                          uint32_t max_payload, uint32_t seq)
+{
+    uint8_t wide = atomic_load_explicit(&bcp->wide_len, memory_order_relaxed);
+    uint8_t head_len = data_head_len(bcp);
+    uint32_t offset = 0;
+    uint32_t index = 0;
+    frame_t *frame = NULL;
+    LIST_FOR_EACH_ENTRY(frame, snd_list, frame_t, node) {
+        uint32_t frame_type = BCP_FRAME_DATA_MIDDLE;
+        if (count == 1) {
+            frame_type = BCP_FRAME_DATA_COMPLETE;
+        } else if (index == 0) {
+            frame_type = BCP_FRAME_DATA_START;
+        } else if (index == count - 1) {
+            frame_type = BCP_FRAME_DATA_END;
+        }
+
+        uint32_t payload_len = index + 1 < count ? max_payload : len - offset;
+        if (bcp->aead != NULL) {
+            data_frame_encrypt(bcp->aead, frame, data + offset, payload_len, frame_type, seq + index, wide);
+        } else {
+            data_frame_pack(frame, data + offset, payload_len, frame_type,
+                            data_crc_len(bcp, head_len + payload_len), wide);
+        }
+        offset += payload_len;
+        index++;
+    }
+}
+
+// Runs a message through the compression stage into lz->tx_buf, it goes
+// raw behind the head when it does not shrink.
+static uint32_t lz_message_pack(lz_session_t *lz, const uint8_t *data, uint32_t len)
+{
+    uint8_t head = 0;
+    if (atomic_exchange_explicit(&lz->tx_reset, 0, memory_order_relaxed)) {
+        bcp_lz_enc_reset(lz->enc);
+        head |= BCP_LZ_MSG_RESET;
+    }
+
+    uint8_t *dst = lz->tx_buf + BCP_LZ_HEAD_LEN;
+    uint32_t packed_len = bcp_lz_compress(lz->enc, dst, len > 0 ? len - 1 : 0, data, len);
+    if (packed_len > 0) {
+        head |= BCP_LZ_MSG_PACKED;
+    } else {
+        memcpy(dst, data, len);
+        packed_len = len;
+    }
+
+    lz->tx_buf[0] = head;
+    return packed_len + BCP_LZ_HEAD_LEN;
+}
+
+// Hands a short message to the worker in a frame with room for a whole
+// aggregate, the worker copies it out or keeps the frame to send in.
+static int32_t agg_message_post(bcp_t *bcp, void *data, uint32_t len)
+{
+    frame_t *frame = (frame_t *)bcp_mem_get(bcp, &bcp->frame_mem_pool, sizeof(frame_t) + bcp->agg_cap + data_frame_extra(bcp));
+    if (frame == NULL) {
+        k_log(BCP_LOG_ERROR, "bcp_send, frame mem get fail\n");
+        return -4;
+    }
+    memcpy(frame->frame_data, data, len);
+    frame->frame_len = len;
+
+    if (bcp_event_post(bcp, frame, agg_message_handle) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp_send, post fail\n");
+        mem_free_to_pool(bcp, frame);
+        return -5;
+    }
+
+    return 0;
+}
+
+// Takes the next slot of the ring, NULL when its frame is still in flight
+// and the pools have to be used.
+static frame_t *fast_slot_take(bcp_t *bcp)
+{
+    uint32_t index = atomic_fetch_add_explicit(&bcp->fast_head, 1, memory_order_relaxed) & (BCP_FAST_SLOT_NUM - 1);
+    uint8_t idle = 0;
+    if (!atomic_compare_exchange_strong_explicit(&bcp->fast_busy[index], &idle, 1,
+                                                 memory_order_acquire, memory_order_relaxed)) {
+        return NULL;
+    }
+
+    return (frame_t *)(bcp->fast_slots + index * bcp->fast_stride);
+}
+
+// A message of one packet is packed in a ring slot and posted as it is.
+static int32_t fast_frame_post(bcp_t *bcp, frame_t *frame, void *data, uint32_t len)
+{
+    uint8_t wide = atomic_load_explicit(&bcp->wide_len, memory_order_relaxed);
+    if (bcp->aead != NULL) {
+        uint32_t seq = 0;
+        if (aead_seq_take(bcp->aead, 1, &seq) != 0) {
+            k_log(BCP_LOG_ERROR, "bcp_send, frame counters used up, recreate the bcp\n");
+            mem_free_to_pool(bcp, frame);
+            return -2;
+        }
+        data_frame_encrypt(bcp->aead, frame, (uint8_t *)data, len, BCP_FRAME_DATA_COMPLETE, seq, wide);
+    } else {
+        data_frame_pack(frame, (uint8_t *)data, len, BCP_FRAME_DATA_COMPLETE,
+                        data_crc_len(bcp, data_head_len(bcp) + len), wide);
+    }
+
+    if (bcp_event_post(bcp, frame, bcp_fast_send_handle) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp_send, post fail\n");
+        mem_free_to_pool(bcp, frame);
+        return -5;
+    }
+
+    return 0;
+}
+
+static int32_t bcp_send_frames(bcp_t *bcp, void *data, uint32_t len)
+{
+    if (len > 0 && len <= atomic_load_explicit(&bcp->agg_max, memory_order_relaxed)) {
+        return agg_message_post(bcp, data, len);
+    }
+
+    // room for the longer trailer is kept as long as CRC-32C may be agreed
+    uint8_t frame_extra = data_frame_extra(bcp);
+    if (len > 0 && len + frame_extra <= bcp->mtu) {
+        frame_t *frame = fast_slot_take(bcp);
+        if (frame != NULL) {
+            return fast_frame_post(bcp, frame, data, len);
+        }
+    }
+
+    // a peer without wide lengths reads 16 bit frame lengths
+    uint32_t mfs = bcp->mfs;
+    if (!atomic_load_explicit(&bcp->wide_len, memory_order_relaxed) && mfs > BCP_NARROW_FRAME_MAX) {
+        mfs = BCP_NARROW_FRAME_MAX;
     }
+    uint32_t max_payload = mfs - frame_extra;
+    uint32_t count = (len + max_payload - 1)/max_payload;
 
-    uint16_t max_payload = bcp->mfs - 8;
-    uint16_t count = (len + max_payload - 1)/max_payload;
+    uint32_t seq = 0;
+    if (bcp->aead != NULL && aead_seq_take(bcp->aead, count, &seq) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp_send, frame counters used up, recreate the bcp\n");
+        return -2;
+    }
 
     k_log(BCP_LOG_DEBUG, "bcp_send, len is %d, divide count is %d, max_payload is %d\n", len, count, max_payload);
 
     int32_t ret = 0;
-    queue_node_t *snd_list = (queue_node_t *)mem_get_from_pool(bcp, &bcp->snd_list_pool);
+    queue_node_t *snd_list = (queue_node_t *)bcp_mem_get(bcp, &bcp->snd_list_pool, sizeof(queue_node_t));
     if (snd_list == NULL) {
         k_log(BCP_LOG_ERROR, "bcp_send, snd list mem get fail\n");
         ret -= 3;
@@ -1070,38 +4342,19 @@ int32_t bcp_send(bcp_block_t *bcp_block, void *data, uint32_t len)
     queue_init(snd_list);
 
     for (uint32_t i = 0; i < count; i++) {
-        frame_t *frame = (frame_t *)mem_get_from_pool(bcp, &bcp->frame_mem_pool);
+        uint32_t payload_len = (i + 1 < count) ? max_payload : len - i * max_payload;
+        frame_t *frame = (frame_t *)bcp_mem_get(bcp, &bcp->frame_mem_pool, sizeof(frame_t) + payload_len + frame_extra);
         if (frame == NULL) {
             k_log(BCP_LOG_ERROR, "bcp_send, frame mem get fail\n");
             ret -= 4;
             goto frame_mem_fail;
         }
 
-        frame->fsn = i;
         queue_init(&frame->node);
         queue_add_tail(&frame->node, snd_list);
     }
 
-    if (count == 1) {
-        frame_t *frame = queue_entry(snd_list->next, frame_t, node);
-        data_frame_pack(frame, data, len, BCP_FRAME_DATA_COMPLETE);
-    }
-    else {
-        uint8_t *start = (uint8_t *)data;
-        uint32_t offset = 0;
-        frame_t *frame = NULL;
-        LIST_FOR_EACH_ENTRY(frame, snd_list, frame_t, node) {
-            if (frame->fsn == 0) {
-                data_frame_pack(frame, start + offset, max_payload - 8, BCP_FRAME_DATA_START);
-                offset += max_payload - 8;
-            } else if (frame->fsn < (count - 1)) {
-                data_frame_pack(frame, start + offset, max_payload - 8, BCP_FRAME_DATA_MIDDLE);
-                offset += max_payload - 8;
-            } else {
-                data_frame_pack(frame, start + offset, len - offset, BCP_FRAME_DATA_END);
-            }
-        }
-    }
+    snd_list_pack(bcp, snd_list, (uint8_t *)data, len, count, max_payload, seq);
 
     if (bcp_event_post(bcp, snd_list, bcp_send_handle) != 0) {
         k_log(BCP_LOG_ERROR, "bcp_send, post fail\n");
@@ -1112,15 +4365,62 @@ int32_t bcp_send(bcp_block_t *bcp_block, void *data, uint32_t len)
     return ret;
 
 send_post_fail:
+frame_mem_fail:
     frame_t *frame = NULL, *next_frame = NULL;
     LIST_FOR_EACH_ENTRY_SAFE(frame, next_frame, snd_list, frame_t, node) {
         queue_del(&frame->node);
         mem_free_to_pool(bcp, frame);
     }
-    
-frame_mem_fail:
     mem_free_to_pool(bcp, snd_list);
 
 snd_list_mem_fail:
     return ret;
 }
+
+static int32_t bcp_send_post(bcp_block_t *bcp_block, void *data, uint32_t len)
+{
+    bcp_t *bcp = bcp_block->bcp;
+    if (len > bcp->mal) {
+        k_log(BCP_LOG_ERROR, "bcp_send, len is too loog, len : %d\n", len);
+        return -1;
+    }
+
+    if (bcp_block == NULL || bcp_block->bcp == NULL) {
+        k_log(BCP_LOG_ERROR, "bcp_send, bcp_block == NULL || bcp_block->bcp == NULL, len : %d\n", len);
+        return -2;
+    }
+
+    if (bcp->status != BCP_DONE) {
+        k_log(BCP_LOG_ERROR, "bcp_send, bcp is not ready, status : %d\n", bcp->status);
+        return -2;
+    }
+
+    lz_session_t *lz = bcp->lz;
+    if (lz == NULL || !atomic_load_explicit(&lz->on, memory_order_relaxed)) {
+        return bcp_send_frames(bcp, data, len);
+    }
+
+    uint32_t packed_len = lz_message_pack(lz, (const uint8_t *)data, len);
+    int32_t ret = bcp_send_frames(bcp, lz->tx_buf, packed_len);
+    if (ret != 0) {
+        // the peer never sees the message the dictionary now holds
+        atomic_store_explicit(&lz->tx_reset, 1, memory_order_relaxed);
+    }
+
+    return ret;
+}
+
+// single thread used
+int32_t bcp_send(bcp_block_t *bcp_block, void *data, uint32_t len)
+{
+    bcp_t *bcp = bcp_block->bcp;
+    if (bcp_session_enter(bcp) != 0) {
+        k_log(BCP_LOG_ERROR, "bcp_send, resume fail\n");
+        return -2;
+    }
+
+    int32_t ret = bcp_send_post(bcp_block, data, len);
+    bcp_session_leave(bcp);
+
+    return ret;
+}
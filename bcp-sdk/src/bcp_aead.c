@@ -0,0 +1,301 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bcp_aead.h"
+
+#define POLY_MASK26                     0x3ffffff
+
+static uint32_t load32_le(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void store32_le(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+//---------------------------------------------------------------------
+// chacha20
+//---------------------------------------------------------------------
+#define ROTL32(v, n)                    ((v) << (n) | (v) >> (32 - (n)))
+
+#define QUARTER_ROUND(a, b, c, d)                           \
+    do {                                                    \
+        a += b; d ^= a; d = ROTL32(d, 16);                  \
+        c += d; b ^= c; b = ROTL32(b, 12);                  \
+        a += b; d ^= a; d = ROTL32(d, 8);                   \
+        c += d; b ^= c; b = ROTL32(b, 7);                   \
+    } while (0)
+
+static void chacha20_block(const uint32_t *state, uint8_t *out)
+{
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+
+    for (uint32_t i = 0; i < 10; i++) {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (uint32_t i = 0; i < 16; i++) {
+        store32_le(out + 4 * i, x[i] + state[i]);
+    }
+}
+
+//---------------------------------------------------------------------
+// poly1305, 26 bit limbs so that 32 bit cpus multiply natively
+//---------------------------------------------------------------------
+static void poly1305_init(bcp_aead_t *aead, const uint8_t *key)
+{
+    aead->r[0] = (load32_le(key + 0)) & 0x3ffffff;
+    aead->r[1] = (load32_le(key + 3) >> 2) & 0x3ffff03;
+    aead->r[2] = (load32_le(key + 6) >> 4) & 0x3ffc0ff;
+    aead->r[3] = (load32_le(key + 9) >> 6) & 0x3f03fff;
+    aead->r[4] = (load32_le(key + 12) >> 8) & 0x00fffff;
+
+    memset(aead->h, 0, sizeof(aead->h));
+    for (uint32_t i = 0; i < 4; i++) {
+        aead->pad[i] = load32_le(key + 16 + 4 * i);
+    }
+    aead->buf_len = 0;
+}
+
+static void poly1305_blocks(bcp_aead_t *aead, const uint8_t *m, uint32_t len)
+{
+    const uint32_t r0 = aead->r[0], r1 = aead->r[1], r2 = aead->r[2], r3 = aead->r[3], r4 = aead->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = aead->h[0], h1 = aead->h[1], h2 = aead->h[2], h3 = aead->h[3], h4 = aead->h[4];
+
+    while (len >= 16) {
+        h0 += (load32_le(m + 0)) & POLY_MASK26;
+        h1 += (load32_le(m + 3) >> 2) & POLY_MASK26;
+        h2 += (load32_le(m + 6) >> 4) & POLY_MASK26;
+        h3 += (load32_le(m + 9) >> 6) & POLY_MASK26;
+        h4 += (load32_le(m + 12) >> 8) | (1u << 24);
+
+        uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        uint32_t c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & POLY_MASK26;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & POLY_MASK26;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & POLY_MASK26;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & POLY_MASK26;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & POLY_MASK26;
+        h0 += c * 5; c = h0 >> 26; h0 &= POLY_MASK26;
+        h1 += c;
+
+        m += 16;
+        len -= 16;
+    }
+
+    aead->h[0] = h0;
+    aead->h[1] = h1;
+    aead->h[2] = h2;
+    aead->h[3] = h3;
+    aead->h[4] = h4;
+}
+
+static void poly1305_update(bcp_aead_t *aead, const uint8_t *m, uint32_t len)
+{
+    if (aead->buf_len != 0) {
+        uint32_t n = 16 - aead->buf_len;
+        n = n > len ? len : n;
+        memcpy(aead->buf + aead->buf_len, m, n);
+        aead->buf_len += n;
+        m += n;
+        len -= n;
+        if (aead->buf_len < 16) {
+            return;
+        }
+        poly1305_blocks(aead, aead->buf, 16);
+        aead->buf_len = 0;
+    }
+
+    uint32_t whole = len & ~15u;
+    poly1305_blocks(aead, m, whole);
+
+    memcpy(aead->buf, m + whole, len - whole);
+    aead->buf_len = len - whole;
+}
+
+// The AEAD construction pads every part to whole blocks.
+static void poly1305_pad(bcp_aead_t *aead)
+{
+    static const uint8_t zero[16];
+    if (aead->buf_len != 0) {
+        poly1305_update(aead, zero, 16 - aead->buf_len);
+    }
+}
+
+static void poly1305_finish(bcp_aead_t *aead, uint8_t *tag)
+{
+    uint32_t h0 = aead->h[0], h1 = aead->h[1], h2 = aead->h[2], h3 = aead->h[3], h4 = aead->h[4];
+
+    uint32_t c = h1 >> 26; h1 &= POLY_MASK26;
+    h2 += c; c = h2 >> 26; h2 &= POLY_MASK26;
+    h3 += c; c = h3 >> 26; h3 &= POLY_MASK26;
+    h4 += c; c = h4 >> 26; h4 &= POLY_MASK26;
+    h0 += c * 5; c = h0 >> 26; h0 &= POLY_MASK26;
+    h1 += c;
+
+    // h - p, taken when it does not borrow
+    uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= POLY_MASK26;
+    uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= POLY_MASK26;
+    uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= POLY_MASK26;
+    uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= POLY_MASK26;
+    uint32_t g4 = h4 + c - (1u << 26);
+
+    uint32_t mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    h0 = h0 | h1 << 26;
+    h1 = h1 >> 6 | h2 << 20;
+    h2 = h2 >> 12 | h3 << 14;
+    h3 = h3 >> 18 | h4 << 8;
+
+    uint64_t f = (uint64_t)h0 + aead->pad[0];
+    store32_le(tag + 0, (uint32_t)f);
+    f = (uint64_t)h1 + aead->pad[1] + (f >> 32);
+    store32_le(tag + 4, (uint32_t)f);
+    f = (uint64_t)h2 + aead->pad[2] + (f >> 32);
+    store32_le(tag + 8, (uint32_t)f);
+    f = (uint64_t)h3 + aead->pad[3] + (f >> 32);
+    store32_le(tag + 12, (uint32_t)f);
+}
+
+//---------------------------------------------------------------------
+// aead
+//---------------------------------------------------------------------
+// Works through the text one key stream block at a time, so that the
+// piece just enciphered is authenticated while it is still in cache.
+static void aead_crypt(bcp_aead_t *aead, uint8_t *dst, const uint8_t *src, uint32_t len, uint8_t encrypt)
+{
+    aead->text_len += len;
+    while (len > 0) {
+        if (aead->stream_used == 64) {
+            chacha20_block(aead->state, aead->stream);
+            aead->state[12]++;
+            aead->stream_used = 0;
+        }
+
+        uint32_t n = 64 - aead->stream_used;
+        n = n > len ? len : n;
+        const uint8_t *ks = aead->stream + aead->stream_used;
+        if (!encrypt) {
+            poly1305_update(aead, src, n);
+        }
+        if (n == 64) {
+            for (uint32_t i = 0; i < 64; i += 8) {
+                uint64_t a, b;
+                memcpy(&a, src + i, 8);
+                memcpy(&b, ks + i, 8);
+                a ^= b;
+                memcpy(dst + i, &a, 8);
+            }
+        } else {
+            for (uint32_t i = 0; i < n; i++) {
+                dst[i] = src[i] ^ ks[i];
+            }
+        }
+        if (encrypt) {
+            poly1305_update(aead, dst, n);
+        }
+
+        aead->stream_used += n;
+        dst += n;
+        src += n;
+        len -= n;
+    }
+}
+
+static void aead_lengths(bcp_aead_t *aead, uint8_t *tag)
+{
+    uint8_t lengths[16] = {0};
+    poly1305_pad(aead);
+    store32_le(lengths, aead->aad_len);
+    store32_le(lengths + 8, aead->text_len);
+    poly1305_update(aead, lengths, sizeof(lengths));
+    poly1305_finish(aead, tag);
+}
+
+//---------------------------------------------------------------------
+// interface
+//---------------------------------------------------------------------
+void bcp_aead_start(bcp_aead_t *aead, const uint8_t *key, const uint8_t *nonce, const void *aad, uint32_t aad_len)
+{
+    aead->state[0] = 0x61707865;
+    aead->state[1] = 0x3320646e;
+    aead->state[2] = 0x79622d32;
+    aead->state[3] = 0x6b206574;
+    for (uint32_t i = 0; i < 8; i++) {
+        aead->state[4 + i] = load32_le(key + 4 * i);
+    }
+    aead->state[12] = 0;
+    for (uint32_t i = 0; i < 3; i++) {
+        aead->state[13 + i] = load32_le(nonce + 4 * i);
+    }
+
+    // block 0 keys poly1305, the text starts with block 1
+    chacha20_block(aead->state, aead->stream);
+    aead->state[12] = 1;
+    aead->stream_used = 64;
+    poly1305_init(aead, aead->stream);
+
+    aead->aad_len = aad_len;
+    aead->text_len = 0;
+    if (aad_len != 0) {
+        poly1305_update(aead, (const uint8_t *)aad, aad_len);
+        poly1305_pad(aead);
+    }
+}
+
+void bcp_aead_encrypt(bcp_aead_t *aead, void *dst, const void *src, uint32_t len)
+{
+    aead_crypt(aead, (uint8_t *)dst, (const uint8_t *)src, len, 1);
+}
+
+void bcp_aead_decrypt(bcp_aead_t *aead, void *dst, const void *src, uint32_t len)
+{
+    aead_crypt(aead, (uint8_t *)dst, (const uint8_t *)src, len, 0);
+}
+
+void bcp_aead_auth(bcp_aead_t *aead, const void *src, uint32_t len)
+{
+    aead->text_len += len;
+    poly1305_update(aead, (const uint8_t *)src, len);
+}
+
+void bcp_aead_finish(bcp_aead_t *aead, uint8_t *tag)
+{
+    aead_lengths(aead, tag);
+}
+
+int32_t bcp_aead_verify(bcp_aead_t *aead, const uint8_t *tag)
+{
+    uint8_t cal_tag[BCP_AEAD_TAG_LEN];
+    aead_lengths(aead, cal_tag);
+
+    uint8_t diff = 0;
+    for (uint32_t i = 0; i < BCP_AEAD_TAG_LEN; i++) {
+        diff |= cal_tag[i] ^ tag[i];
+    }
+    return diff == 0 ? 0 : -1;
+}
@@ -0,0 +1,95 @@
+#ifndef __BCP_AEAD_H__
+#define __BCP_AEAD_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BCP_AEAD_KEY_LEN                32
+#define BCP_AEAD_NONCE_LEN              12
+#define BCP_AEAD_TAG_LEN                16
+
+/**
+ * ChaCha20-Poly1305 (RFC 8439) state of one message. The text may be fed
+ * in pieces of any length, each byte is enciphered and authenticated in
+ * the same pass.
+ */
+typedef struct {
+    uint32_t state[16];                 // chacha20 input, block counter in word 12
+    uint8_t stream[64];                 // current key stream block
+    uint8_t stream_used;
+    uint8_t buf_len;
+    uint8_t buf[16];                    // poly1305 input not yet a full block
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+    uint32_t aad_len;
+    uint32_t text_len;
+} bcp_aead_t;
+
+/**
+ * @brief Starts a message and authenticates its associated data.
+ *
+ * @param aead The state to set up.
+ * @param key The 32 byte key.
+ * @param nonce The 12 byte nonce, never to be used twice with the same key.
+ * @param aad Data authenticated but not enciphered, may be NULL if aad_len is 0.
+ * @param aad_len Length of aad in bytes.
+ */
+void bcp_aead_start(bcp_aead_t *aead, const uint8_t *key, const uint8_t *nonce, const void *aad, uint32_t aad_len);
+
+/**
+ * @brief Enciphers a piece of the message and authenticates the result.
+ *
+ * @param aead The state of the message.
+ * @param dst Destination of the cipher text, may be src.
+ * @param src The plain text.
+ * @param len Length of the piece in bytes.
+ */
+void bcp_aead_encrypt(bcp_aead_t *aead, void *dst, const void *src, uint32_t len);
+
+/**
+ * @brief Authenticates a piece of the cipher text and deciphers it.
+ *
+ * @param aead The state of the message.
+ * @param dst Destination of the plain text, may be src.
+ * @param src The cipher text.
+ * @param len Length of the piece in bytes.
+ */
+void bcp_aead_decrypt(bcp_aead_t *aead, void *dst, const void *src, uint32_t len);
+
+/**
+ * @brief Authenticates a piece of the cipher text without deciphering it,
+ * to seal a message again under other associated data.
+ *
+ * @param aead The state of the message.
+ * @param src The cipher text.
+ * @param len Length of the piece in bytes.
+ */
+void bcp_aead_auth(bcp_aead_t *aead, const void *src, uint32_t len);
+
+/**
+ * @brief Ends the message and computes its tag.
+ *
+ * @param aead The state of the message.
+ * @param tag Receives the 16 byte tag.
+ */
+void bcp_aead_finish(bcp_aead_t *aead, uint8_t *tag);
+
+/**
+ * @brief Ends the message and compares its tag in constant time.
+ *
+ * @param aead The state of the message.
+ * @param tag The 16 byte tag received with the message.
+ *
+ * @return 0 if the tag matches, -1 otherwise.
+ */
+int32_t bcp_aead_verify(bcp_aead_t *aead, const uint8_t *tag);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,495 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bcp_crc.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC_CLMUL_X86                   1
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+#include <nmmintrin.h>
+#define CRC_CLMUL_TARGET                __attribute__((target("pclmul,ssse3")))
+#define CRC32C_HW_X86                   1
+#define CRC32C_HW_TARGET                __attribute__((target("sse4.2")))
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#define CRC_CLMUL_NEON                  1
+#include <arm_neon.h>
+#define CRC_CLMUL_TARGET
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CRC32C_HW_ARM                   1
+#include <arm_acle.h>
+#define CRC32C_HW_TARGET
+#endif
+
+#define CRC16_POLY                      0x1021
+#define CRC32C_POLY                     0x82F63B78u     // reflected
+
+// Below this length the setup of the carry-less path does not pay off.
+#ifndef BCP_CRC_CLMUL_MIN
+#define BCP_CRC_CLMUL_MIN               32
+#endif
+
+// crc16_table[k][b] is the CRC of byte b followed by k zero bytes.
+static uint16_t crc16_table[8][256];
+// crc16_pow8[k] is x^(8 * 2^k) mod P, it moves a CRC over 2^k zero bytes.
+static uint16_t crc16_pow8[32];
+static uint8_t crc16_clmul_ok;
+
+// CRC-32C runs reflected, bit 31 holds the coefficient of x^0.
+static uint32_t crc32c_table[256];
+static uint32_t crc32c_pow8[32];
+static uint8_t crc32c_hw_ok;
+
+//---------------------------------------------------------------------
+// slicing by 8
+//---------------------------------------------------------------------
+static uint16_t crc16_byte(uint16_t crc, uint8_t byte)
+{
+    return (uint16_t)(crc << 8) ^ crc16_table[0][(crc >> 8) ^ byte];
+}
+
+static uint16_t crc16_slice8(uint16_t crc, const uint8_t *p)
+{
+    return crc16_table[7][(crc >> 8) ^ p[0]] ^ crc16_table[6][(crc & 0xFF) ^ p[1]] ^
+           crc16_table[5][p[2]] ^ crc16_table[4][p[3]] ^
+           crc16_table[3][p[4]] ^ crc16_table[2][p[5]] ^
+           crc16_table[1][p[6]] ^ crc16_table[0][p[7]];
+}
+
+static uint16_t crc16_table_update(uint16_t crc, const uint8_t *p, uint32_t len)
+{
+    while (len >= 8) {
+        crc = crc16_slice8(crc, p);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len-- > 0) {
+        crc = crc16_byte(crc, *p++);
+    }
+
+    return crc;
+}
+
+static uint16_t crc16_table_copy(uint16_t crc, uint8_t *dst, const uint8_t *src, uint32_t len)
+{
+    uint8_t block[8];
+    while (len >= 8) {
+        memcpy(block, src, 8);
+        memcpy(dst, block, 8);
+        crc = crc16_slice8(crc, block);
+        src += 8;
+        dst += 8;
+        len -= 8;
+    }
+
+    while (len-- > 0) {
+        *dst++ = *src;
+        crc = crc16_byte(crc, *src++);
+    }
+
+    return crc;
+}
+
+// a * b mod P
+static uint16_t crc16_mulmod(uint16_t a, uint16_t b)
+{
+    uint16_t r = 0;
+    for (int32_t i = 15; i >= 0; i--) {
+        r = (r & 0x8000) ? (uint16_t)(r << 1) ^ CRC16_POLY : (uint16_t)(r << 1);
+        if (b & (1u << i)) {
+            r ^= a;
+        }
+    }
+    return r;
+}
+
+static void crc16_table_build(void)
+{
+    for (uint32_t b = 0; b < 256; b++) {
+        uint16_t crc = (uint16_t)(b << 8);
+        for (uint32_t i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (uint16_t)(crc << 1) ^ CRC16_POLY : (uint16_t)(crc << 1);
+        }
+        crc16_table[0][b] = crc;
+    }
+
+    for (uint32_t k = 1; k < 8; k++) {
+        for (uint32_t b = 0; b < 256; b++) {
+            uint16_t prev = crc16_table[k - 1][b];
+            crc16_table[k][b] = (uint16_t)(prev << 8) ^ crc16_table[0][prev >> 8];
+        }
+    }
+
+    crc16_pow8[0] = 0x0100;
+    for (uint32_t k = 1; k < 32; k++) {
+        crc16_pow8[k] = crc16_mulmod(crc16_pow8[k - 1], crc16_pow8[k - 1]);
+    }
+}
+
+//---------------------------------------------------------------------
+// carry-less multiply
+//---------------------------------------------------------------------
+#if defined(CRC_CLMUL_X86) || defined(CRC_CLMUL_NEON)
+
+// x^192 and x^128 mod P move a 128 bit block forward by 16 bytes, x^576
+// and x^512 mod P by 64 bytes. The higher power sits in lane 1.
+static uint64_t crc16_fold_k[2][2];
+
+static uint64_t crc16_xpow(uint32_t n)
+{
+    uint32_t r = 1;
+    while (n-- > 0) {
+        r <<= 1;
+        if (r & 0x10000) {
+            r ^= 0x10000 | CRC16_POLY;
+        }
+    }
+    return r;
+}
+
+// A vector holds 16 bytes of the message as a 128 bit polynomial, lane 1
+// has the coefficients of x^64 to x^127, which are the first 8 bytes.
+#if defined(CRC_CLMUL_X86)
+typedef __m128i crc_vec_t;
+
+CRC_CLMUL_TARGET
+static crc_vec_t crc_vec_swap(crc_vec_t v)
+{
+    return _mm_shuffle_epi8(v, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+// Loads 16 bytes, and copies them to out unless it is NULL.
+CRC_CLMUL_TARGET
+static crc_vec_t crc_vec_take(const uint8_t *p, uint8_t *out)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    if (out != NULL) {
+        _mm_storeu_si128((__m128i *)out, v);
+    }
+    return crc_vec_swap(v);
+}
+
+CRC_CLMUL_TARGET
+static void crc_vec_store(uint8_t *p, crc_vec_t v)
+{
+    _mm_storeu_si128((__m128i *)p, crc_vec_swap(v));
+}
+
+CRC_CLMUL_TARGET
+static crc_vec_t crc_vec_make(uint64_t hi, uint64_t lo)
+{
+    return _mm_set_epi64x((long long)hi, (long long)lo);
+}
+
+CRC_CLMUL_TARGET
+static crc_vec_t crc_vec_xor(crc_vec_t a, crc_vec_t b)
+{
+    return _mm_xor_si128(a, b);
+}
+
+// v * x^n + add, with k = {x^n, x^(n+64)} mod P
+CRC_CLMUL_TARGET
+static crc_vec_t crc_fold(crc_vec_t v, crc_vec_t k, crc_vec_t add)
+{
+    crc_vec_t hi = _mm_clmulepi64_si128(v, k, 0x11);
+    crc_vec_t lo = _mm_clmulepi64_si128(v, k, 0x00);
+    return _mm_xor_si128(_mm_xor_si128(hi, lo), add);
+}
+
+#else
+typedef uint64x2_t crc_vec_t;
+
+static crc_vec_t crc_vec_swap(crc_vec_t v)
+{
+    uint8x16_t b = vrev64q_u8(vreinterpretq_u8_u64(v));
+    return vreinterpretq_u64_u8(vextq_u8(b, b, 8));
+}
+
+static crc_vec_t crc_vec_take(const uint8_t *p, uint8_t *out)
+{
+    uint8x16_t v = vld1q_u8(p);
+    if (out != NULL) {
+        vst1q_u8(out, v);
+    }
+    return crc_vec_swap(vreinterpretq_u64_u8(v));
+}
+
+static void crc_vec_store(uint8_t *p, crc_vec_t v)
+{
+    vst1q_u8(p, vreinterpretq_u8_u64(crc_vec_swap(v)));
+}
+
+static crc_vec_t crc_vec_make(uint64_t hi, uint64_t lo)
+{
+    return vcombine_u64(vcreate_u64(lo), vcreate_u64(hi));
+}
+
+static crc_vec_t crc_vec_xor(crc_vec_t a, crc_vec_t b)
+{
+    return veorq_u64(a, b);
+}
+
+static crc_vec_t crc_fold(crc_vec_t v, crc_vec_t k, crc_vec_t add)
+{
+    poly128_t hi = vmull_p64((poly64_t)vgetq_lane_u64(v, 1), (poly64_t)vgetq_lane_u64(k, 1));
+    poly128_t lo = vmull_p64((poly64_t)vgetq_lane_u64(v, 0), (poly64_t)vgetq_lane_u64(k, 0));
+    return veorq_u64(veorq_u64(vreinterpretq_u64_p128(hi), vreinterpretq_u64_p128(lo)), add);
+}
+#endif
+
+// Folds the data down to one 128 bit block congruent to it mod P, the
+// table engine then reduces that block and the tail. len is at least 32.
+// The data is copied to out on the way unless out is NULL.
+CRC_CLMUL_TARGET
+static uint16_t crc16_clmul(uint16_t crc, const uint8_t *data, uint32_t len, uint8_t *out)
+{
+    crc_vec_t v[4];
+    crc_vec_t k16 = crc_vec_make(crc16_fold_k[0][1], crc16_fold_k[0][0]);
+    crc_vec_t k64 = crc_vec_make(crc16_fold_k[1][1], crc16_fold_k[1][0]);
+    uint32_t lanes = len >= 128 ? 4 : 1;
+    uint32_t done = 0;
+
+    for (uint32_t i = 0; i < lanes; i++) {
+        v[i] = crc_vec_take(data + 16 * i, out ? out + 16 * i : NULL);
+    }
+    // a running crc enters as the first two bytes
+    v[0] = crc_vec_xor(v[0], crc_vec_make((uint64_t)crc << 48, 0));
+    done = 16 * lanes;
+
+    // four blocks 64 bytes apart hide the latency of the multiply
+    while (lanes == 4 && len - done >= 64) {
+        for (uint32_t i = 0; i < 4; i++) {
+            v[i] = crc_fold(v[i], k64, crc_vec_take(data + done + 16 * i, out ? out + done + 16 * i : NULL));
+        }
+        done += 64;
+    }
+
+    for (uint32_t i = 1; i < lanes; i++) {
+        v[0] = crc_fold(v[0], k16, v[i]);
+    }
+
+    while (len - done >= 16) {
+        v[0] = crc_fold(v[0], k16, crc_vec_take(data + done, out ? out + done : NULL));
+        done += 16;
+    }
+
+    uint8_t block[16];
+    crc_vec_store(block, v[0]);
+    crc = crc16_table_update(0, block, sizeof(block));
+
+    if (out != NULL) {
+        return crc16_table_copy(crc, out + done, data + done, len - done);
+    }
+    return crc16_table_update(crc, data + done, len - done);
+}
+
+static uint8_t crc16_clmul_probe(void)
+{
+    crc16_fold_k[0][0] = crc16_xpow(128);
+    crc16_fold_k[0][1] = crc16_xpow(192);
+    crc16_fold_k[1][0] = crc16_xpow(512);
+    crc16_fold_k[1][1] = crc16_xpow(576);
+
+#if defined(CRC_CLMUL_X86)
+    __builtin_cpu_init();
+    return (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3")) ? 1 : 0;
+#else
+    return 1;
+#endif
+}
+
+#else
+
+static uint16_t crc16_clmul(uint16_t crc, const uint8_t *data, uint32_t len, uint8_t *out)
+{
+    if (out != NULL) {
+        return crc16_table_copy(crc, out, data, len);
+    }
+    return crc16_table_update(crc, data, len);
+}
+
+static uint8_t crc16_clmul_probe(void)
+{
+    return 0;
+}
+
+#endif
+
+//---------------------------------------------------------------------
+// crc-32c
+//---------------------------------------------------------------------
+// a * b mod P
+static uint32_t crc32c_mulmod(uint32_t a, uint32_t b)
+{
+    uint32_t r = 0;
+    for (uint32_t m = 0x80000000u; m != 0; m >>= 1) {
+        if (a & m) {
+            r ^= b;
+        }
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return r;
+}
+
+static void crc32c_table_build(void)
+{
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (uint32_t i = 0; i < 8; i++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[b] = crc;
+    }
+
+    crc32c_pow8[0] = 0x00800000u;
+    for (uint32_t k = 1; k < 32; k++) {
+        crc32c_pow8[k] = crc32c_mulmod(crc32c_pow8[k - 1], crc32c_pow8[k - 1]);
+    }
+}
+
+// Works on the raw register, without the initial and final inversion. The
+// data is copied to out on the way unless out is NULL.
+static uint32_t crc32c_table_update(uint32_t crc, const uint8_t *data, uint32_t len, uint8_t *out)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        if (out != NULL) {
+            out[i] = data[i];
+        }
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ data[i]) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(CRC32C_HW_X86) || defined(CRC32C_HW_ARM)
+CRC32C_HW_TARGET
+static uint32_t crc32c_hw_update(uint32_t crc, const uint8_t *data, uint32_t len, uint8_t *out)
+{
+    uint64_t crc64 = crc;
+    uint64_t word;
+    while (len >= 8) {
+        memcpy(&word, data, 8);
+        if (out != NULL) {
+            memcpy(out, &word, 8);
+            out += 8;
+        }
+#if defined(CRC32C_HW_X86)
+        crc64 = _mm_crc32_u64(crc64, word);
+#else
+        crc64 = __crc32cd((uint32_t)crc64, word);
+#endif
+        data += 8;
+        len -= 8;
+    }
+
+    return crc32c_table_update((uint32_t)crc64, data, len, out);
+}
+
+static uint8_t crc32c_hw_probe(void)
+{
+#if defined(CRC32C_HW_X86)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") ? 1 : 0;
+#else
+    return 1;
+#endif
+}
+
+#else
+
+static uint32_t crc32c_hw_update(uint32_t crc, const uint8_t *data, uint32_t len, uint8_t *out)
+{
+    return crc32c_table_update(crc, data, len, out);
+}
+
+static uint8_t crc32c_hw_probe(void)
+{
+    return 0;
+}
+
+#endif
+
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *data, uint32_t len, uint8_t *out)
+{
+    crc = ~crc;
+    if (crc32c_hw_ok) {
+        crc = crc32c_hw_update(crc, data, len, out);
+    } else {
+        crc = crc32c_table_update(crc, data, len, out);
+    }
+    return ~crc;
+}
+
+//---------------------------------------------------------------------
+// interface
+//---------------------------------------------------------------------
+void bcp_crc_init(void)
+{
+    crc16_table_build();
+    crc16_clmul_ok = crc16_clmul_probe();
+
+    crc32c_table_build();
+    crc32c_hw_ok = crc32c_hw_probe();
+}
+
+uint16_t bcp_crc16_update(uint16_t crc, const void *data, uint32_t len)
+{
+    if (crc16_clmul_ok && len >= BCP_CRC_CLMUL_MIN) {
+        return crc16_clmul(crc, (const uint8_t *)data, len, NULL);
+    }
+    return crc16_table_update(crc, (const uint8_t *)data, len);
+}
+
+uint16_t bcp_crc16_copy(uint16_t crc, void *dst, const void *src, uint32_t len)
+{
+    if (crc16_clmul_ok && len >= BCP_CRC_CLMUL_MIN) {
+        return crc16_clmul(crc, (const uint8_t *)src, len, (uint8_t *)dst);
+    }
+    return crc16_table_copy(crc, (uint8_t *)dst, (const uint8_t *)src, len);
+}
+
+uint16_t bcp_crc16_weight(uint32_t tail_len)
+{
+    uint16_t weight = 1;
+    for (uint32_t k = 0; tail_len != 0; k++, tail_len >>= 1) {
+        if (tail_len & 1) {
+            weight = crc16_mulmod(weight, crc16_pow8[k]);
+        }
+    }
+    return weight;
+}
+
+uint16_t bcp_crc16_patch(uint16_t crc, uint8_t delta, uint16_t weight)
+{
+    return crc ^ crc16_mulmod(crc16_table[0][delta], weight);
+}
+
+uint32_t bcp_crc32c_update(uint32_t crc, const void *data, uint32_t len)
+{
+    return crc32c_update(crc, (const uint8_t *)data, len, NULL);
+}
+
+uint32_t bcp_crc32c_copy(uint32_t crc, void *dst, const void *src, uint32_t len)
+{
+    return crc32c_update(crc, (const uint8_t *)src, len, (uint8_t *)dst);
+}
+
+uint32_t bcp_crc32c_weight(uint32_t tail_len)
+{
+    uint32_t weight = 0x80000000u;
+    for (uint32_t k = 0; tail_len != 0; k++, tail_len >>= 1) {
+        if (tail_len & 1) {
+            weight = crc32c_mulmod(weight, crc32c_pow8[k]);
+        }
+    }
+    return weight;
+}
+
+uint32_t bcp_crc32c_patch(uint32_t crc, uint8_t delta, uint32_t weight)
+{
+    // the inversions cancel out, only the raw crc of the change is left
+    return crc ^ crc32c_mulmod(crc32c_table[delta], weight);
+}
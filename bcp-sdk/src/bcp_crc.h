@@ -0,0 +1,113 @@
+#ifndef __BCP_CRC_H__
+#define __BCP_CRC_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Builds the CRC tables and picks the fastest engine of the CPU.
+ *
+ * Called by bcp_adapter_port_init, before any other function of this file.
+ */
+void bcp_crc_init(void);
+
+/**
+ * @brief Continues a CRC-16/XMODEM over a buffer.
+ *
+ * @param crc The CRC of the data before the buffer, 0 to start.
+ * @param data Pointer to the data buffer.
+ * @param len The length of the data buffer in bytes.
+ *
+ * @return The CRC of the data including the buffer.
+ */
+uint16_t bcp_crc16_update(uint16_t crc, const void *data, uint32_t len);
+
+/**
+ * @brief Copies a buffer and continues a CRC-16/XMODEM over it in one pass.
+ *
+ * @param crc The CRC of the data before the buffer, 0 to start.
+ * @param dst Destination of the copy, must not overlap src.
+ * @param src Pointer to the data buffer.
+ * @param len The length of the data buffer in bytes.
+ *
+ * @return The CRC of the data including the buffer.
+ */
+uint16_t bcp_crc16_copy(uint16_t crc, void *dst, const void *src, uint32_t len);
+
+/**
+ * @brief Computes the weight of a byte followed by tail_len bytes in a CRC.
+ *
+ * The CRC has no final xor, so it is linear in the data. Changing one byte
+ * changes the CRC by an amount that only depends on the change and on the
+ * number of checksummed bytes after it.
+ *
+ * @param tail_len Number of checksummed bytes after the byte.
+ *
+ * @return The weight to pass to bcp_crc16_patch.
+ */
+uint16_t bcp_crc16_weight(uint32_t tail_len);
+
+/**
+ * @brief Updates a CRC-16/XMODEM for one changed byte without touching the data.
+ *
+ * @param crc The CRC before the change.
+ * @param delta The old value of the byte xor its new value.
+ * @param weight The weight of the byte, from bcp_crc16_weight.
+ *
+ * @return The CRC after the change.
+ */
+uint16_t bcp_crc16_patch(uint16_t crc, uint8_t delta, uint16_t weight);
+
+/**
+ * @brief Continues a CRC-32C over a buffer.
+ *
+ * Uses the SSE4.2 or ARMv8 CRC instructions when the CPU has them.
+ *
+ * @param crc The CRC of the data before the buffer, 0 to start.
+ * @param data Pointer to the data buffer.
+ * @param len The length of the data buffer in bytes.
+ *
+ * @return The CRC of the data including the buffer.
+ */
+uint32_t bcp_crc32c_update(uint32_t crc, const void *data, uint32_t len);
+
+/**
+ * @brief Copies a buffer and continues a CRC-32C over it in one pass.
+ *
+ * @param crc The CRC of the data before the buffer, 0 to start.
+ * @param dst Destination of the copy, must not overlap src.
+ * @param src Pointer to the data buffer.
+ * @param len The length of the data buffer in bytes.
+ *
+ * @return The CRC of the data including the buffer.
+ */
+uint32_t bcp_crc32c_copy(uint32_t crc, void *dst, const void *src, uint32_t len);
+
+/**
+ * @brief Computes the weight of a byte followed by tail_len bytes in a CRC-32C.
+ *
+ * @param tail_len Number of checksummed bytes after the byte.
+ *
+ * @return The weight to pass to bcp_crc32c_patch.
+ */
+uint32_t bcp_crc32c_weight(uint32_t tail_len);
+
+/**
+ * @brief Updates a CRC-32C for one changed byte without touching the data.
+ *
+ * @param crc The CRC before the change.
+ * @param delta The old value of the byte xor its new value.
+ * @param weight The weight of the byte, from bcp_crc32c_weight.
+ *
+ * @return The CRC after the change.
+ */
+uint32_t bcp_crc32c_patch(uint32_t crc, uint8_t delta, uint32_t weight);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
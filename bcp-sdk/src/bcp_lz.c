@@ -0,0 +1,273 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bcp_lz.h"
+
+// A compressed message is a run of sequences: a token, the literals, a 2
+// byte offset back into the stream and the rest of the match length. The
+// token holds the literal count in its high nibble and the match length
+// minus LZ_MATCH_MIN in the low one, 15 meaning that bytes follow which
+// add up until one is below 255. The last sequence may end after its
+// literals.
+#define LZ_MATCH_MIN                    4
+#define LZ_RUN_MASK                     15
+#define LZ_OFFSET_MAX                   65535
+#define LZ_POS_MAX                      0x80000000u
+#define LZ_SKIP_SHIFT                   5       // every 32 misses in a row lengthen the step by one
+
+static uint32_t load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - BCP_LZ_HASH_BITS);
+}
+
+//---------------------------------------------------------------------
+// dictionary
+//---------------------------------------------------------------------
+void bcp_lz_dict_reset(bcp_lz_dict_t *dict)
+{
+    dict->hist_len = 0;
+}
+
+void bcp_lz_dict_append(bcp_lz_dict_t *dict, const uint8_t *src, uint32_t len)
+{
+    if (len >= BCP_LZ_WINDOW) {
+        memcpy(dict->hist, src + len - BCP_LZ_WINDOW, BCP_LZ_WINDOW);
+        dict->hist_len = BCP_LZ_WINDOW;
+        return;
+    }
+
+    uint32_t keep = dict->hist_len + len > BCP_LZ_WINDOW ? BCP_LZ_WINDOW - len : dict->hist_len;
+    memmove(dict->hist, dict->hist + dict->hist_len - keep, keep);
+    memcpy(dict->hist + keep, src, len);
+    dict->hist_len = keep + len;
+}
+
+//---------------------------------------------------------------------
+// encoder
+//---------------------------------------------------------------------
+void bcp_lz_enc_reset(bcp_lz_enc_t *enc)
+{
+    bcp_lz_dict_reset(&enc->dict);
+    memset(enc->table, 0, sizeof(enc->table));
+    enc->pos = 0;
+}
+
+// Length of the match at src[i] with the bytes dist before it, which may
+// start in the dictionary and run on into the message.
+static uint32_t lz_match_len(const bcp_lz_dict_t *dict, const uint8_t *src, uint32_t len, uint32_t i, uint32_t dist)
+{
+    uint32_t n = 0;
+    if (dist > i) {
+        const uint8_t *from = dict->hist + dict->hist_len - (dist - i);
+        uint32_t avail = dist - i;
+        while (n < avail && i + n < len && from[n] == src[i + n]) {
+            n++;
+        }
+        if (n < avail) {
+            return n;
+        }
+    }
+
+    while (i + n < len && src[i + n - dist] == src[i + n]) {
+        n++;
+    }
+    return n;
+}
+
+static uint8_t *lz_len_write(uint8_t *op, uint32_t n)
+{
+    n -= LZ_RUN_MASK;
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+// Returns NULL when the sequence does not fit before dst_end.
+static uint8_t *lz_sequence_put(uint8_t *op, const uint8_t *dst_end, const uint8_t *lit, uint32_t lit_len,
+                                uint32_t dist, uint32_t match_len)
+{
+    uint32_t need = 1 + lit_len / 255 + 1 + lit_len + (match_len > 0 ? 2 + match_len / 255 + 1 : 0);
+    if (need > (uint32_t)(dst_end - op)) {
+        return NULL;
+    }
+
+    uint32_t run = match_len > 0 ? match_len - LZ_MATCH_MIN : 0;
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit_len < LZ_RUN_MASK ? lit_len : LZ_RUN_MASK) << 4 | (run < LZ_RUN_MASK ? run : LZ_RUN_MASK));
+    if (lit_len >= LZ_RUN_MASK) {
+        op = lz_len_write(op, lit_len);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len > 0) {
+        *op++ = (uint8_t)dist;
+        *op++ = (uint8_t)(dist >> 8);
+        if (run >= LZ_RUN_MASK) {
+            op = lz_len_write(op, run);
+        }
+    }
+    return op;
+}
+
+uint32_t bcp_lz_compress(bcp_lz_enc_t *enc, uint8_t *dst, uint32_t dst_cap, const uint8_t *src, uint32_t len)
+{
+    // stream offsets are kept far from wrapping, the dictionary bytes
+    // stay usable once hashed again
+    if (enc->pos > LZ_POS_MAX) {
+        memset(enc->table, 0, sizeof(enc->table));
+        enc->pos = 0;
+    }
+
+    uint8_t *op = dst;
+    const uint8_t *dst_end = dst + dst_cap;
+    uint32_t anchor = 0;
+    uint32_t misses = 0;
+    uint32_t i = 0;
+    while (i + LZ_MATCH_MIN <= len) {
+        uint32_t h = lz_hash(load32(src + i));
+        uint32_t cand = enc->table[h];
+        enc->table[h] = enc->pos + i + 1;
+
+        uint32_t dist = 0;
+        uint32_t match_len = 0;
+        if (cand != 0) {
+            dist = enc->pos + i - (cand - 1);
+            if (dist > 0 && dist <= i + enc->dict.hist_len && dist <= LZ_OFFSET_MAX) {
+                match_len = lz_match_len(&enc->dict, src, len, i, dist);
+            }
+        }
+
+        // incompressible data is skipped through faster and faster
+        if (match_len < LZ_MATCH_MIN) {
+            i += 1 + (misses++ >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        op = lz_sequence_put(op, dst_end, src + anchor, i - anchor, dist, match_len);
+        if (op == NULL) {
+            goto give_up;
+        }
+        i += match_len;
+        anchor = i;
+        misses = 0;
+
+        if (i + LZ_MATCH_MIN <= len) {
+            enc->table[lz_hash(load32(src + i - 2))] = enc->pos + i - 2 + 1;
+        }
+    }
+
+    if (anchor < len) {
+        op = lz_sequence_put(op, dst_end, src + anchor, len - anchor, 0, 0);
+        if (op == NULL) {
+            goto give_up;
+        }
+    }
+
+    bcp_lz_dict_append(&enc->dict, src, len);
+    enc->pos += len;
+    return (uint32_t)(op - dst);
+
+give_up:
+    bcp_lz_dict_append(&enc->dict, src, len);
+    enc->pos += len;
+    return 0;
+}
+
+//---------------------------------------------------------------------
+// decoder
+//---------------------------------------------------------------------
+static int32_t lz_len_read(const uint8_t **ip, const uint8_t *end, uint32_t *n, uint32_t limit)
+{
+    uint8_t b;
+    do {
+        if (*ip == end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *n += b;
+        if (*n > limit) {
+            return -1;
+        }
+    } while (b == 255);
+
+    return 0;
+}
+
+int32_t bcp_lz_decompress(bcp_lz_dict_t *dict, uint8_t *dst, uint32_t dst_cap, const uint8_t *src, uint32_t len)
+{
+    const uint8_t *ip = src;
+    const uint8_t *end = src + len;
+    uint32_t op = 0;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        uint32_t lit_len = token >> 4;
+        if (lit_len == LZ_RUN_MASK && lz_len_read(&ip, end, &lit_len, dst_cap) != 0) {
+            return -1;
+        }
+        if (lit_len > (uint32_t)(end - ip) || lit_len > dst_cap - op) {
+            return -1;
+        }
+        memcpy(dst + op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        uint32_t dist = ip[0] | (uint32_t)ip[1] << 8;
+        ip += 2;
+
+        uint32_t match_len = token & LZ_RUN_MASK;
+        if (match_len == LZ_RUN_MASK && lz_len_read(&ip, end, &match_len, dst_cap) != 0) {
+            return -1;
+        }
+        match_len += LZ_MATCH_MIN;
+        if (dist == 0 || dist > op + dict->hist_len || match_len > dst_cap - op) {
+            return -1;
+        }
+
+        if (dist > op) {
+            uint32_t n = dist - op;
+            n = n < match_len ? n : match_len;
+            memcpy(dst + op, dict->hist + dict->hist_len - (dist - op), n);
+            op += n;
+            match_len -= n;
+        }
+
+        if (match_len == 0) {
+            continue;
+        }
+
+        // an offset shorter than the match repeats the bytes just written
+        const uint8_t *from = dst + op - dist;
+        if (dist >= match_len) {
+            memcpy(dst + op, from, match_len);
+        } else {
+            for (uint32_t k = 0; k < match_len; k++) {
+                dst[op + k] = from[k];
+            }
+        }
+        op += match_len;
+    }
+
+    bcp_lz_dict_append(dict, dst, op);
+    return (int32_t)op;
+}
@@ -0,0 +1,86 @@
+#ifndef __BCP_LZ_H__
+#define __BCP_LZ_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BCP_LZ_WINDOW                   4096
+#define BCP_LZ_HASH_BITS                11
+
+/**
+ * The last BCP_LZ_WINDOW bytes of a stream of messages. Matches may reach
+ * back into it, so repeated keys and values across messages cost a few
+ * bytes each. Both ends must append the same messages in the same order.
+ */
+typedef struct {
+    uint8_t hist[BCP_LZ_WINDOW];        // oldest byte first
+    uint32_t hist_len;
+} bcp_lz_dict_t;
+
+typedef struct {
+    bcp_lz_dict_t dict;
+    uint32_t pos;                       // stream offset of the next message
+    uint32_t table[1 << BCP_LZ_HASH_BITS]; // stream offset + 1 of the last 4 bytes hashed there, 0 for none
+} bcp_lz_enc_t;
+
+/**
+ * @brief Empties a dictionary.
+ *
+ * @param dict The dictionary.
+ */
+void bcp_lz_dict_reset(bcp_lz_dict_t *dict);
+
+/**
+ * @brief Appends a message sent without compression to a dictionary.
+ *
+ * @param dict The dictionary.
+ * @param src The message.
+ * @param len Length of the message in bytes.
+ */
+void bcp_lz_dict_append(bcp_lz_dict_t *dict, const uint8_t *src, uint32_t len);
+
+/**
+ * @brief Empties the dictionary and match table of an encoder.
+ *
+ * @param enc The encoder.
+ */
+void bcp_lz_enc_reset(bcp_lz_enc_t *enc);
+
+/**
+ * @brief Compresses a message against the dictionary, then appends it.
+ *
+ * The message is appended whatever the outcome, the decoding end appends
+ * it as well when it comes in raw.
+ *
+ * @param enc The encoder.
+ * @param dst Destination of the compressed message.
+ * @param dst_cap Room in dst, compression is given up beyond it.
+ * @param src The message.
+ * @param len Length of the message in bytes.
+ *
+ * @return Length of the compressed message, 0 if it does not fit in dst_cap.
+ */
+uint32_t bcp_lz_compress(bcp_lz_enc_t *enc, uint8_t *dst, uint32_t dst_cap, const uint8_t *src, uint32_t len);
+
+/**
+ * @brief Decompresses a message against the dictionary, then appends it.
+ *
+ * @param dict The dictionary.
+ * @param dst Destination of the message.
+ * @param dst_cap Room in dst.
+ * @param src The compressed message.
+ * @param len Length of the compressed message in bytes.
+ *
+ * @return Length of the message, -1 if src is malformed, reaches out of
+ * the dictionary or does not fit in dst_cap. The dictionary is left as is.
+ */
+int32_t bcp_lz_decompress(bcp_lz_dict_t *dict, uint8_t *dst, uint32_t dst_cap, const uint8_t *src, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
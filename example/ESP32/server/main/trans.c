@@ -110,13 +110,29 @@ static void ble_connected_handle(uint8_t conn_id)
     bcp_parm.mal = 4096;
     bcp_parm.mfs_scale = 4;
     bcp_parm.mtu = 497;
+    bcp_parm.byte_stream = 0;
+    bcp_parm.slab = NULL;
+    bcp_parm.slab_quota = 0;
+    bcp_parm.frame_pool_max = 0;
+    bcp_parm.mtu_pool_max = 0;
+    bcp_parm.hibernate_ms = 0;
+    bcp_parm.crc32c = 0;
+    bcp_parm.transport = BCP_TRANSPORT_PROFILE_RAW;
+    bcp_parm.compress = 0;
+    bcp_parm.aggregate_ms = 0;
+    bcp_parm.wide_len = 0;
+    bcp_parm.aead_key = NULL;
+    bcp_parm.work_mode = BCP_WORK_MODE_THREAD;
+    bcp_parm.executor = NULL;
     bcp_parm.work_thread_name = "bcp_thread";
     bcp_parm.work_thread_priority = 3;
     bcp_parm.work_thread_stack_size = 4096*3;
 
     bcp_interface_t bcp_interface;
     bcp_interface.output = ble_send;
+    bcp_interface.output_batch = NULL;
     bcp_interface.data_listener = recv_data_from_bcp;
+    bcp_interface.event_notify = NULL;
 
     bcp_block = bcp_create(&bcp_parm, &bcp_interface, &ble_con_id);
     if (bcp_block == NULL) {